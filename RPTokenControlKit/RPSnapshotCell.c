@@ -0,0 +1,126 @@
+#include "RPSnapshotCell.h"
+#include <sched.h>
+#include <stdlib.h>
+
+static void RPSnapshotCellLockRetired(RPSnapshotCell* cell) {
+	while (atomic_flag_test_and_set_explicit(&cell->retiredLock, memory_order_acquire)) {
+		// Holders only append a pointer or swap the list, so this is brief
+		sched_yield() ;
+	}
+}
+
+static bool RPSnapshotCellTryLockRetired(RPSnapshotCell* cell) {
+	return !atomic_flag_test_and_set_explicit(&cell->retiredLock, memory_order_acquire) ;
+}
+
+static void RPSnapshotCellUnlockRetired(RPSnapshotCell* cell) {
+	atomic_flag_clear_explicit(&cell->retiredLock, memory_order_release) ;
+}
+
+void RPSnapshotCellInit(RPSnapshotCell* cell,
+						void* snapshot,
+						RPSnapshotCellRetainCallback retain,
+						RPSnapshotCellReleaseCallback release) {
+	atomic_init(&cell->current, snapshot) ;
+	atomic_init(&cell->readerCount, 0) ;
+	atomic_init(&cell->hasRetired, false) ;
+	atomic_flag_clear(&cell->retiredLock) ;
+	cell->retired = NULL ;
+	cell->retiredCount = 0 ;
+	cell->retiredCapacity = 0 ;
+	cell->retain = retain ;
+	cell->release = release ;
+}
+
+void RPSnapshotCellDestroy(RPSnapshotCell* cell) {
+	size_t i ;
+	for (i=0; i<cell->retiredCount; i++) {
+		cell->release(cell->retired[i]) ;
+	}
+	free(cell->retired) ;
+	cell->retired = NULL ;
+	cell->retiredCount = 0 ;
+	cell->retiredCapacity = 0 ;
+
+	void* current = atomic_exchange(&cell->current, NULL) ;
+	if (current) {
+		cell->release(current) ;
+	}
+}
+
+void RPSnapshotCellReclaim(RPSnapshotCell* cell) {
+	void** reclaimables = NULL ;
+	size_t reclaimablesCount = 0 ;
+	if (RPSnapshotCellTryLockRetired(cell)) {
+		if (atomic_load(&cell->readerCount) == 0) {
+			reclaimables = cell->retired ;
+			reclaimablesCount = cell->retiredCount ;
+			cell->retired = NULL ;
+			cell->retiredCount = 0 ;
+			cell->retiredCapacity = 0 ;
+			atomic_store(&cell->hasRetired, false) ;
+		}
+		RPSnapshotCellUnlockRetired(cell) ;
+	}
+
+	// Released outside of the lock, since deallocating snapshots may take
+	// a while
+	size_t i ;
+	for (i=0; i<reclaimablesCount; i++) {
+		cell->release(reclaimables[i]) ;
+	}
+	free(reclaimables) ;
+}
+
+void* RPSnapshotCellCopyCurrent(RPSnapshotCell* cell) {
+	// While any reader is counted, writers do not release the snapshots
+	// which they replace, so the snapshot we load cannot be deallocated
+	// before we have retained it.
+	atomic_fetch_add(&cell->readerCount, 1) ;
+	void* snapshot = cell->retain(atomic_load(&cell->current)) ;
+	long priorReaderCount = atomic_fetch_sub(&cell->readerCount, 1) ;
+	if ((priorReaderCount == 1) && atomic_load(&cell->hasRetired)) {
+		RPSnapshotCellReclaim(cell) ;
+	}
+
+	return snapshot ;
+}
+
+bool RPSnapshotCellReplace(RPSnapshotCell* cell,
+						   void* expected,
+						   void* desired) {
+	if (!atomic_compare_exchange_strong(&cell->current, &expected, desired)) {
+		return false ;
+	}
+
+	// Some reader may have loaded expected but not yet retained it, so
+	// instead of releasing the cell's reference to expected now, we retire it.
+	RPSnapshotCellLockRetired(cell) ;
+	if (cell->retiredCount == cell->retiredCapacity) {
+		size_t capacity = (cell->retiredCapacity > 0) ? 2*cell->retiredCapacity : 8 ;
+		void** retired = realloc(cell->retired, capacity * sizeof(void*)) ;
+		if (!retired) {
+			// Cannot retire it, so we must leak it rather than risk a reader
+			// retaining it after it has been deallocated
+			RPSnapshotCellUnlockRetired(cell) ;
+			return true ;
+		}
+		cell->retired = retired ;
+		cell->retiredCapacity = capacity ;
+	}
+	cell->retired[cell->retiredCount++] = expected ;
+	atomic_store(&cell->hasRetired, true) ;
+	RPSnapshotCellUnlockRetired(cell) ;
+
+	RPSnapshotCellReclaim(cell) ;
+
+	return true ;
+}
+
+size_t RPSnapshotCellRetiredCount(RPSnapshotCell* cell) {
+	RPSnapshotCellLockRetired(cell) ;
+	size_t count = cell->retiredCount ;
+	RPSnapshotCellUnlockRetired(cell) ;
+
+	return count ;
+}
@@ -0,0 +1,120 @@
+#ifndef RPSnapshotCell_h
+#define RPSnapshotCell_h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*!
+ @brief    Callback which adds a reference to a snapshot, and returns it
+*/
+typedef void* (*RPSnapshotCellRetainCallback)(void* snapshot) ;
+
+/*!
+ @brief    Callback which removes a reference from a snapshot, deallocating
+ it if that was the last reference
+*/
+typedef void (*RPSnapshotCellReleaseCallback)(void* snapshot) ;
+
+/*!
+ @brief    A cell holding a pointer to a reference-counted, immutable
+ snapshot, which any thread may read or replace without blocking readers
+
+ @details  RPSnapshotCell is plain C11 so that it may be tested apart from
+ Cocoa.  RPTokenControl uses it to publish its RPTokenControlSnapshots.
+
+ Loading the pointer and retaining the snapshot it points to are two
+ steps, and a writer could replace and release the snapshot in between.
+ So, each reader increments readerCount before loading, and decrements it
+ after retaining.  A writer does not release the snapshot which it replaced,
+ but appends it to a list of retired snapshots.  Retired snapshots are
+ released only when readerCount is seen to be 0, at which time no reader
+ could be about to retain one of them, because any reader which increments
+ readerCount after that will load a newer snapshot.
+
+ The retired list is guarded by a spin lock which writers take only to
+ append a pointer, and which readers only try.  Readers never wait.
+
+ The members of this struct are private.  Use the functions below.
+*/
+typedef struct RPSnapshotCell {
+	_Atomic(void*) current ;
+	// Number of threads now between loading current and retaining it
+	atomic_long readerCount ;
+	atomic_bool hasRetired ;
+	// Guards retired, retiredCount and retiredCapacity
+	atomic_flag retiredLock ;
+	void** retired ;
+	size_t retiredCount ;
+	size_t retiredCapacity ;
+	RPSnapshotCellRetainCallback retain ;
+	RPSnapshotCellReleaseCallback release ;
+} RPSnapshotCell ;
+
+/*!
+ @brief    Initializes a cell with an initial snapshot
+
+ @param    snapshot  The initial snapshot.  The cell takes ownership of
+ one reference to it.  Must not be NULL.
+*/
+void RPSnapshotCellInit(RPSnapshotCell* cell,
+						void* snapshot,
+						RPSnapshotCellRetainCallback retain,
+						RPSnapshotCellReleaseCallback release) ;
+
+/*!
+ @brief    Releases the current snapshot and all retired snapshots of a cell
+
+ @details  No other thread may be using the cell when this is invoked.
+*/
+void RPSnapshotCellDestroy(RPSnapshotCell* cell) ;
+
+/*!
+ @brief    Returns the current snapshot of a cell, retained
+
+ @details  May be invoked on any thread.  Never blocks.
+ @result   A snapshot to which the caller owns one reference
+*/
+void* RPSnapshotCellCopyCurrent(RPSnapshotCell* cell) ;
+
+/*!
+ @brief    Atomically replaces the current snapshot of a cell, if it is a
+ given expected snapshot, with a new snapshot
+
+ @details  May be invoked on any thread.  Never waits for readers.
+ The caller must own a reference to expected, normally obtained from
+ RPSnapshotCellCopyCurrent(), so that it cannot be deallocated and its
+ address reused while the caller is deriving the new snapshot.
+ @param    desired  The new snapshot.  If successful, the cell takes
+ ownership of one reference to it.  Otherwise, the caller keeps it.
+ @result   true if successful, false if the current snapshot was not
+ expected, because another thread has replaced it.  In the latter case, the
+ caller should get the new current snapshot, derive a new snapshot from it,
+ and try again.
+*/
+bool RPSnapshotCellReplace(RPSnapshotCell* cell,
+						   void* expected,
+						   void* desired) ;
+
+/*!
+ @brief    Releases retired snapshots of a cell, if no thread could be about
+ to retain one of them
+
+ @details  Never blocks.  If another thread is now retiring or reclaiming
+ snapshots, does nothing, and the retired snapshots will be released by a
+ later reader or writer.  Readers and writers invoke this as needed, so
+ you need not invoke it, except to drain the retired list at a particular
+ time.
+*/
+void RPSnapshotCellReclaim(RPSnapshotCell* cell) ;
+
+/*!
+ @brief    Returns the number of snapshots of a cell which have been
+ replaced but not yet released
+
+ @details  Intended for testing.  The answer may be stale by the time it is
+ returned, unless no other thread is using the cell.
+*/
+size_t RPSnapshotCellRetiredCount(RPSnapshotCell* cell) ;
+
+#endif /* RPSnapshotCell_h */
@@ -1,5 +1,7 @@
 #import <Cocoa/Cocoa.h>
 
+@class RPTokenLayoutContext ;
+
 extern id const SSYNoTokensMarker ;
 
 #define RPTokenFancyEffectReflection 1
@@ -41,6 +43,17 @@ typedef enum RPTokenControlTokenColorScheme_enum RPTokenControlTokenColorScheme
  
  If objectValue is nil, the view will display the No Tokens placeholder.
  
+ objectValue, tokenizingCharacter and linkDragType may be read and set on any
+ thread, without locking.  They are published together as an immutable
+ snapshot, so collections set as objectValue are copied, and mutating
+ a collection after setting it has no effect on the control.  When objectValue
+ is set on a secondary thread, the selection and layout are updated
+ asynchronously on the main thread.  Conversely, the collection returned by
+ objectValue, and passed to KVO observers, is the snapshot itself, which other
+ threads may be reading.  Do not mutate it.  This matters for NSCountedSet,
+ which has no immutable variant, so that objectValue may return an
+ NSCountedSet even though you set some other kind of collection.  If you need
+ to change it, make a mutable copy, change that, and set it as objectValue.
  </li>
  <li>
  <h4>NSMutableIndexSet* selectedIndexSet</h4>
@@ -173,6 +186,19 @@ typedef enum RPTokenControlTokenColorScheme_enum RPTokenControlTokenColorScheme
  dragged bookmark's "tags", thus "tagging" the dragged bookmark.
  </li>
  <li>
+ <h4>RPTokenLayoutContext* layoutContext</h4>
+ The object which caches measured and rendered tokens for the receiver.
+ Several RPTokenControls may share one layoutContext.
+ If not set, the receiver creates its own private layoutContext.
+ See RPTokenLayoutContext.h.
+ </li>
+ <li>
+ <h4>BOOL cellStyle</h4>
+ Defines whether or not the receiver is drawn in a lightweight mode suitable
+ for use in many rows of a table view.  See -setCellStyle:.
+ Default value is NO.
+ </li>
+ <li>
  <h4>NSImage* dragImage</h4>
  Defines the cursor image that will be shown when a token is dragged.
  If not set, Cocoa uses a default image. </li>
@@ -344,8 +370,12 @@ typedef enum RPTokenControlEditability_enum RPTokenControlEditability ;
  editability to a value >= RPTokenControlEditability1.  The 'object'
  of the posted notification will be the affected RPTokenControl.  The 'userInfo'
  dictionary of the posted notification will contain one key,
- RPTokenControlUserDeletedTokensKey, whose value is an array of strings
- which are the deleted tokens.
+ RPTokenControlUserDeletedTokensKey, whose value is a set of strings
+ which are the tokens actually deleted.  It is posted once per deletion,
+ after objectValue has changed, and is not posted if, because another thread
+ changed objectValue meanwhile, none of the selected tokens remained to be
+ deleted.  To see the tokens as they were before the deletion, observe
+ objectValue with NSKeyValueObservingOptionOld.
  
  Note added 20121203: This notification nonsense is maybe very stupid.  I'm
  thinking that I should have instead declared a delegate method for deleting
@@ -387,7 +417,6 @@ NSDraggingSource,
 NSPasteboardWriting,
 NSAccessibilityGroup
 > {
-    id m_objectValue ;
     NSInteger _maxTokensToDisplay ;
     NSInteger _firstTokenToDisplay ;
     NSInteger _fancyEffects ;
@@ -412,23 +441,23 @@ NSAccessibilityGroup
     NSCharacterSet* m_disallowedCharacterSet ;
     NSString* m_replacementString ;
     NSCharacterSet* m_tokenizingCharacterSet ;
-    unichar m_tokenizingCharacter ;
     NSString* m_noTokensPlaceholder ;
     NSString* m_noSelectionPlaceholder ;
     NSString* m_multipleValuesPlaceholder ;
     NSString* m_notApplicablePlaceholder ;
     NSObject <RPTokenControlDelegate> * m_delegate ;
-    NSString* _linkDragType ;
     NSMutableIndexSet* _selectedIndexSet ;
-    NSMutableString* _tokenBeingEdited ;
+    NSString* _tokenBeingEdited ;
     NSInteger _indexOfFramedTokenBeingEdited ;
     NSTextField* _textField ;
     BOOL _isDoingLayout ;
+    BOOL _cellStyle ;
+    RPTokenLayoutContext* _layoutContext ;
     NSPoint _mouseDownPoint ; // for hysteresis in beginning drag
 }
 
 @property (retain) NSImage* dragImage ;
-@property (retain) NSMutableString* tokenBeingEdited ;
+@property (copy) NSString* tokenBeingEdited ;
 @property (copy) NSString* linkDragType ;
 @property (assign) NSObject <RPTokenControlDelegate> * delegate ;
 @property (retain) NSCharacterSet* disallowedCharacterSet ;
@@ -441,6 +470,8 @@ NSAccessibilityGroup
 @property (copy) NSString* notApplicablePlaceholder ;
 @property (assign) CGFloat fixedFontSize ;
 @property (assign) RPTokenControlEditability editability ;
+@property (retain) RPTokenLayoutContext* layoutContext ;
+@property (assign, getter=isCellStyle) BOOL cellStyle ;
 
 /*!
  @brief    An NSArray of the tokens selected in the control view
@@ -544,5 +575,33 @@ NSAccessibilityGroup
  */
 - (void)setEditability:(RPTokenControlEditability)editability ;
 
+/*!
+ @brief    setter for ivar layoutContext
+ @details  Invoking this method will recalculate the receiver's layout
+ and mark the receiver with -setNeedsDisplay.
+ To share cached measurements and rendered tokens among several
+ RPTokenControls, set the same layoutContext in all of them.
+ Passing nil causes the receiver to create a new private layoutContext
+ the next time one is needed.
+ */
+- (void)setLayoutContext:(RPTokenLayoutContext*)layoutContext ;
+
+/*!
+ @brief    setter for ivar cellStyle
+ @details  Set this to YES when the receiver is one of many, for example
+ one in each row of a table view.  In cell style, the receiver
+ <ul>
+ <li>ignores any enclosing scroll view, and lays out tokens only within its
+ own frame, truncating with an ellipsis token if necessary.  (The enclosing
+ scroll view of a control in a table view cell is that of the table.)</li>
+ <li>does not install a toolTip rect for each token.</li>
+ <li>does not create the text field subview used for typing in new tokens,
+ so typing in new tokens is not possible.</li>
+ </ul>
+ Invoking this method will recalculate the receiver's layout
+ and mark the receiver with -setNeedsDisplay.
+ */
+- (void)setCellStyle:(BOOL)cellStyle ;
+
 
 @end
@@ -1,8 +1,10 @@
 #import "RPTokenControl.h"
 #import "RPBlackReflectionUtils.h"
 #import "RPCountedToken.h"
+#import "RPTokenLayoutContext.h"
 #import "NSView+FocusRing.h"
 #import "SSY+Countability.h"
+#include "RPSnapshotCell.h"
 
 NSString* const RPTokenControlUserDeletedTokensNotification = @"RPTokenControlUserDeletedTokensNotification" ;
 NSString* const RPTokenControlUserDeletedTokensKey = @"RPTokenControlUserDeletedTokensKey" ;
@@ -76,10 +78,89 @@ NSRange SSMakeRangeIncludingEndIndexes(NSInteger b1, NSInteger b2) {
 
 @end
 
+@interface NSObject (RemoveStringsFromCollection)
+
+/*!
+ @brief    If the receiver is a collection, returns a copy of it from which
+ each string in a given set, and each RPCountedToken whose text is in that
+ set, has been removed; otherwise returns nil.
+
+ @details  If the receiver is an NSArray or NSSet, the copy is immutable,
+ and is built in one pass over the receiver.  If the receiver is an
+ NSCountedSet, the copy is an NSCountedSet, since there is no immutable
+ counted set, and each given string is removed entirely, not just one of
+ its occurrences.
+ @param    deletedStrings  On output, those of the given strings which were
+ found in the receiver will have been added to this set.
+ @result   A retained object, which the caller must release.
+*/
+- (id)copyRemovingStrings:(NSSet*)strings
+		   deletedStrings:(NSMutableSet*)deletedStrings ;
+
+@end
+
+@implementation NSObject (RemoveStringsFromCollection)
+
+- (id)copyRemovingStrings:(NSSet*)strings
+		   deletedStrings:(NSMutableSet*)deletedStrings {
+	if (![self conformsToProtocol:@protocol(NSFastEnumeration)]) {
+		return nil ;
+	}
+	
+	id output = nil ;
+	Class countedTokenClass = [RPCountedToken class] ;
+	if ([self isKindOfClass:[NSCountedSet class]]) {
+		output = [self mutableCopy] ;
+		// -removeObject: only decrements the count of an object, and
+		// NSCountedSet has no method to remove an object outright, so we
+		// decrement as many times as needed.
+		for (NSString* string in strings) {
+			NSUInteger nToRemove = [(NSCountedSet*)output countForObject:string] ;
+			if (nToRemove > 0) {
+				[deletedStrings addObject:string] ;
+			}
+			for (NSUInteger i=0; i<nToRemove; i++) {
+				[(NSCountedSet*)output removeObject:string] ;
+			}
+		}
+	}
+	else if ([self isKindOfClass:[NSArray class]]) {
+		NSIndexSet* keptIndexes = [(NSArray*)self indexesOfObjectsPassingTest:^BOOL(id object, NSUInteger idx, BOOL* stop) {
+			NSString* string = [object isKindOfClass:countedTokenClass] ? [(RPCountedToken*)object text] : object ;
+			if ([strings containsObject:string]) {
+				[deletedStrings addObject:string] ;
+				return NO ;
+			}
+			return YES ;
+		}] ;
+		output = [[(NSArray*)self objectsAtIndexes:keptIndexes] retain] ;
+	}
+	else if ([self isKindOfClass:[NSSet class]]) {
+		output = [[(NSSet*)self objectsPassingTest:^BOOL(id object, BOOL* stop) {
+			NSString* string = [object isKindOfClass:countedTokenClass] ? [(RPCountedToken*)object text] : object ;
+			if ([strings containsObject:string]) {
+				[deletedStrings addObject:string] ;
+				return NO ;
+			}
+			return YES ;
+		}] retain] ;
+	}
+	else {
+		output = [self copy] ;
+	}
+	
+	return output ;
+}
+
+@end
+
 @interface FramedToken : NSObject {
 	RPCountedToken* _token ;
 	NSRect _bounds ;
 	float _fontsize ;
+	// Keys of rendered images, deselected and selected, for _renderStyleKey
+	NSString* _renderStyleKey ;
+	NSString* _renderKeys[2] ;
 }
 @end
 
@@ -108,11 +189,12 @@ float const tokenBoxTextInset = 2.0 ;
 				 fontSize:(float)fontSize
        cornerRadiusFactor:(float)cornerRadiusFactor
    widthPaddingMultiplier:(float)widthPaddingMultiplier
-			  appendCount:(BOOL)appendCount {
-	NSDictionary *attr = [NSDictionary dictionaryWithObject:[self fontOfSize:fontSize]
-													 forKey:NSFontAttributeName] ;				
+			  appendCount:(BOOL)appendCount
+			layoutContext:(RPTokenLayoutContext*)layoutContext {
 	NSString *str = appendCount ? [token textWithCountAppended] : [token text] ;
-	NSSize size = [str sizeWithAttributes:attr] ;
+	// Measuring text is expensive, so we let layoutContext cache it
+	NSSize size = [layoutContext textSizeForString:str
+										  fontSize:fontSize] ;
 	// Add padding space around text
     CGFloat widthPadding = [self widthPaddingForHeight:size.height
                                               fontSize:fontSize
@@ -138,6 +220,9 @@ float const tokenBoxTextInset = 2.0 ;
 - (void)dealloc {
 #if !__has_feature(objc_arc)
 	[_token release];
+	[_renderStyleKey release] ;
+	[_renderKeys[0] release] ;
+	[_renderKeys[1] release] ;
 #endif
 
 	[super dealloc];
@@ -204,7 +289,21 @@ float const tokenBoxTextInset = 2.0 ;
 
 - (void)drawWithAttributes:(NSDictionary*)attr
 			   appendCount:(BOOL)appendCount {
-	NSRect rect = NSMakeRect(_bounds.origin.x, _bounds.origin.y, _bounds.size.width-3, _bounds.size.height-3) ;
+	[self drawInBounds:_bounds
+		withAttributes:attr
+		   appendCount:appendCount] ;
+}
+
+/*!
+ @brief    Draws the receiver in given bounds, which may differ from the
+ receiver's bounds
+
+ @details  Used to render the receiver into a cached image, at the origin.
+*/
+- (void)drawInBounds:(NSRect)bounds
+	  withAttributes:(NSDictionary*)attr
+		 appendCount:(BOOL)appendCount {
+	NSRect rect = NSMakeRect(bounds.origin.x, bounds.origin.y, bounds.size.width-3, bounds.size.height-3) ;
 
     CGFloat cornerRadiusFactor = [[attr objectForKey:TCCornerRadiusFactorAttributeName] floatValue] ;
     CGFloat widthPaddingMultiplier = [[attr objectForKey:TCWidthPaddingMultiplierAttributeName] floatValue] ;
@@ -248,7 +347,7 @@ float const tokenBoxTextInset = 2.0 ;
                                            cornerRadiusFactor:cornerRadiusFactor
                                        widthPaddingMultiplier:widthPaddingMultiplier] ;
 
-	[text drawAtPoint:NSMakePoint(_bounds.origin.x + widthPadding/2, _bounds.origin.y+1)
+	[text drawAtPoint:NSMakePoint(bounds.origin.x + widthPadding/2, bounds.origin.y+1)
 	   withAttributes:attr];
 }
 
@@ -256,6 +355,288 @@ float const tokenBoxTextInset = 2.0 ;
 	return _token ;
 }
 
+/*!
+ @brief    Returns a key which identifies the image of the receiver as drawn
+ in a given style, selected or not
+
+ @details  The key is only built when the style changes, so that drawing
+ need not format a string for each token in each -drawRect:.  The receiver's
+ size never changes, so it is part of the key only for the benefit of
+ other controls which share the same cache.
+ @param    styleKey  Identifies everything other than the token itself and
+ its selection which affects its drawing
+*/
+- (NSString*)renderKeyForStyle:(NSString*)styleKey
+				   appendCount:(BOOL)appendCount
+					isSelected:(BOOL)isSelected {
+	if (![styleKey isEqualToString:_renderStyleKey]) {
+		NSString* text = appendCount ? [_token textWithCountAppended] : [_token text] ;
+		NSString* baseKey = [NSString stringWithFormat:@"%@\t%g\t%g\t%g\t%@",
+							 text,
+							 _fontsize,
+							 _bounds.size.width,
+							 _bounds.size.height,
+							 styleKey] ;
+#if !__has_feature(objc_arc)
+		[_renderStyleKey release] ;
+		[_renderKeys[0] release] ;
+		[_renderKeys[1] release] ;
+#endif
+		_renderStyleKey = [styleKey copy] ;
+		_renderKeys[0] = [[baseKey stringByAppendingString:@"\t0"] copy] ;
+		_renderKeys[1] = [[baseKey stringByAppendingString:@"\t1"] copy] ;
+	}
+	
+	return _renderKeys[isSelected ? 1 : 0] ;
+}
+
+@end
+
+/*!
+ @brief    The part of the layout of an RPTokenControl which does not depend
+ on the width of the control
+
+ @details  Contains the displayed tokens, already ranked, sized and sorted,
+ as FramedTokens whose origins are set each time that the tokens are broken
+ into lines.  Also caches the line breaks and line heights for recently used
+ widths, so that, for example, toggling the vertical scroller back and forth
+ is cheap.
+*/
+@interface TokenLayoutCore : NSObject {
+	NSMutableArray* _framedTokens ;
+	FramedToken* _ellipsisFramedToken ;
+	NSInteger _indexOfTokenBeingEdited ;
+	unsigned long long _objectValueVersion ;
+	float _gap ;
+	// Counts of the tokens' counts, to tell when a count no longer occurs
+	NSCountedSet* _tokenCounts ;
+	// _prefixWidths[k] is the total width of the first k tokens plus one gap
+	// per token, so the width of any run of tokens is found by subtraction.
+	CGFloat* _prefixWidths ;
+	NSMutableDictionary* _linesForWidths ;
+}
+@end
+
+NSUInteger const TokenLayoutCoreMaxCachedWidths = 16 ;
+
+/*!
+ @brief    One line of tokens, as cached by TokenLayoutCore for a given width
+*/
+typedef struct {
+	// Index of the first token in the line
+	NSInteger start ;
+	// Height of the tallest token in the line
+	float height ;
+} TokenLayoutLine ;
+
+@implementation TokenLayoutCore
+
+/*!
+ @brief    Recomputes _prefixWidths for the tokens from a given index on
+
+ @details  Entries up to and including the given index are assumed to be
+ still valid.
+*/
+- (void)computePrefixWidthsFromIndex:(NSInteger)firstIndex {
+	NSInteger nTokens = [_framedTokens count] ;
+	_prefixWidths = realloc(_prefixWidths, (nTokens + 1) * sizeof(CGFloat)) ;
+	_prefixWidths[0] = 0.0 ;
+	NSInteger i ;
+	for (i=firstIndex; i<nTokens; i++) {
+		FramedToken* framedToken = [_framedTokens objectAtIndex:i] ;
+		_prefixWidths[i+1] = _prefixWidths[i] + [framedToken bounds].size.width + _gap ;
+	}
+	
+	// Line breaks computed from old widths are no longer valid
+	[_linesForWidths removeAllObjects] ;
+}
+
+- (id)initWithFramedTokens:(NSArray*)framedTokens
+	   ellipsisFramedToken:(FramedToken*)ellipsisFramedToken
+   indexOfTokenBeingEdited:(NSInteger)indexOfTokenBeingEdited
+		objectValueVersion:(unsigned long long)objectValueVersion
+					   gap:(float)gap {
+	if ((self = [super init])) {
+		_framedTokens = [framedTokens mutableCopy] ;
+		_ellipsisFramedToken = [ellipsisFramedToken retain] ;
+		_indexOfTokenBeingEdited = indexOfTokenBeingEdited ;
+		_objectValueVersion = objectValueVersion ;
+		_gap = gap ;
+		_tokenCounts = [[NSCountedSet alloc] init] ;
+		for (FramedToken* framedToken in _framedTokens) {
+			[_tokenCounts addObject:[NSNumber numberWithInteger:[[framedToken token] count]]] ;
+		}
+		_linesForWidths = [[NSMutableDictionary alloc] init] ;
+		[self computePrefixWidthsFromIndex:0] ;
+	}
+	
+	return self ;
+}
+
+- (void)dealloc {
+	free(_prefixWidths) ;
+#if !__has_feature(objc_arc)
+	[_framedTokens release] ;
+	[_ellipsisFramedToken release] ;
+	[_tokenCounts release] ;
+	[_linesForWidths release] ;
+
+	[super dealloc] ;
+#endif
+}
+
+- (NSArray*)framedTokens {
+	return _framedTokens ;
+}
+
+- (FramedToken*)ellipsisFramedToken {
+	return _ellipsisFramedToken ;
+}
+
+- (NSInteger)indexOfTokenBeingEdited {
+	return _indexOfTokenBeingEdited ;
+}
+
+/*!
+ @brief    The version of the RPTokenControlSnapshot whose objectValue the
+ receiver's tokens were taken from
+*/
+- (unsigned long long)objectValueVersion {
+	return _objectValueVersion ;
+}
+
+- (void)setObjectValueVersion:(unsigned long long)objectValueVersion {
+	_objectValueVersion = objectValueVersion ;
+}
+
+/*!
+ @brief    Returns whether or not, among the receiver's tokens, all of the
+ tokens of some count are at given indexes
+
+ @details  If so, removing them would change the rank, and thus possibly the
+ font size, of tokens of other counts.  Cost is O(indexes).
+*/
+- (BOOL)allTokensOfSomeCountAreAtIndexes:(NSIndexSet*)indexes {
+	NSCountedSet* countsAtIndexes = [[NSCountedSet alloc] init] ;
+	NSUInteger i = [indexes firstIndex] ;
+	while (i != NSNotFound) {
+		[countsAtIndexes addObject:[NSNumber numberWithInteger:[[[_framedTokens objectAtIndex:i] token] count]]] ;
+		i = [indexes indexGreaterThanIndex:i] ;
+	}
+	
+	BOOL answer = NO ;
+	for (NSNumber* count in countsAtIndexes) {
+		if ([countsAtIndexes countForObject:count] == [_tokenCounts countForObject:count]) {
+			answer = YES ;
+			break ;
+		}
+	}
+#if !__has_feature(objc_arc)
+	[countsAtIndexes release];
+#endif
+	
+	return answer ;
+}
+
+/*!
+ @brief    Removes the tokens at given indexes, closing the gaps
+
+ @details  Does not change the sizes or order of the remaining tokens, so
+ this is only valid if the removal would not change the rank of their counts.
+ See -allTokensOfSomeCountAreAtIndexes:.
+*/
+- (void)removeFramedTokensAtIndexes:(NSIndexSet*)indexes {
+	if ([indexes count] == 0) {
+		return ;
+	}
+	
+	NSUInteger i = [indexes firstIndex] ;
+	while (i != NSNotFound) {
+		[_tokenCounts removeObject:[NSNumber numberWithInteger:[[[_framedTokens objectAtIndex:i] token] count]]] ;
+		i = [indexes indexGreaterThanIndex:i] ;
+	}
+	
+	if (_indexOfTokenBeingEdited != NSNotFound) {
+		if ([indexes containsIndex:_indexOfTokenBeingEdited]) {
+			_indexOfTokenBeingEdited = NSNotFound ;
+		}
+		else {
+			_indexOfTokenBeingEdited -= [indexes countOfIndexesInRange:NSMakeRange(0, _indexOfTokenBeingEdited)] ;
+		}
+	}
+	
+	[_framedTokens removeObjectsAtIndexes:indexes] ;
+	// Widths of tokens before the first removed token are unchanged
+	[self computePrefixWidthsFromIndex:[indexes firstIndex]] ;
+}
+
+/*!
+ @brief    Returns the width of a given run of tokens laid out with the
+ minimum gap between them
+*/
+- (CGFloat)widthOfTokensInRange:(NSRange)range {
+	return _prefixWidths[NSMaxRange(range)] - _prefixWidths[range.location] - _gap ;
+}
+
+/*!
+ @brief    Returns the lines into which the receiver's tokens are broken for
+ a given width, as a C array of TokenLayoutLine in an NSData
+
+ @details  The first token of a line is always placed, even if it is wider
+ than the given width.  Each following token is placed if it fits.
+ Since _prefixWidths is increasing, the end of each line is found by binary
+ search.  The height of each line is found by scanning its tokens, but only
+ when the lines are not cached, so that a cache hit costs O(1).
+*/
+- (NSData*)linesForWidth:(float)width {
+	NSNumber* key = [NSNumber numberWithFloat:width] ;
+	NSData* lines = [_linesForWidths objectForKey:key] ;
+	if (!lines) {
+		NSMutableData* mutableLines = [[NSMutableData alloc] init] ;
+		NSInteger nTokens = [_framedTokens count] ;
+		NSInteger start = 0 ;
+		while (start < nTokens) {
+			// Tokens start..<end fit if their widthOfTokensInRange: <= width,
+			// that is, if _prefixWidths[end] <= limit.  Find the largest end.
+			CGFloat limit = _prefixWidths[start] + width + _gap ;
+			NSInteger low = start + 1 ;
+			NSInteger high = nTokens ;
+			while (low < high) {
+				NSInteger middle = (low + high + 1) / 2 ;
+				if (_prefixWidths[middle] <= limit) {
+					low = middle ;
+				}
+				else {
+					high = middle - 1 ;
+				}
+			}
+			
+			TokenLayoutLine line ;
+			line.start = start ;
+			line.height = 0.0 ;
+			NSInteger i ;
+			for (i=start; i<low; i++) {
+				float height = [[_framedTokens objectAtIndex:i] bounds].size.height ;
+				if (height > line.height) {
+					line.height = height ;
+				}
+			}
+			[mutableLines appendBytes:&line
+							   length:sizeof(TokenLayoutLine)] ;
+			start = low ;
+		}
+		
+		if ([_linesForWidths count] >= TokenLayoutCoreMaxCachedWidths) {
+			[_linesForWidths removeAllObjects] ;
+		}
+		[_linesForWidths setObject:mutableLines
+							forKey:key] ;
+		lines = [mutableLines autorelease] ;
+	}
+	
+	return lines ;
+}
+
 @end
 
 //@interface NSSet (ConvertToRPCountedTokens)
@@ -402,6 +783,138 @@ float const tokenBoxTextInset = 2.0 ;
 
 @end
 
+/*!
+ @brief    An immutable, versioned snapshot of the model state of an
+ RPTokenControl which may be read or written from any thread
+
+ @details  RPTokenControl publishes a new snapshot by swapping an atomic
+ pointer, so that readers (layout, drawing, accessibility, and threads which
+ push new tokens) never block one another.  Retired snapshots are released
+ only after all readers which might have loaded them have retained them.
+ See -[RPTokenControl snapshot] and -replaceSnapshot:withSnapshot:.
+
+ The objectValue of a snapshot is never mutated.  While the user is typing
+ in a new token, each keystroke publishes a new snapshot containing an
+ immutable copy of the text typed so far.
+*/
+@interface RPTokenControlSnapshot : NSObject {
+	id _objectValue ;
+	unichar _tokenizingCharacter ;
+	NSString* _linkDragType ;
+	unsigned long long _version ;
+}
+
+@end
+
+@implementation RPTokenControlSnapshot
+
+- (id)initWithObjectValue:(id)objectValue
+	  tokenizingCharacter:(unichar)tokenizingCharacter
+			 linkDragType:(NSString*)linkDragType
+				  version:(unsigned long long)version {
+	if ((self = [super init])) {
+		// Not copied, since snapshotWithUnsharedObjectValue: adopts a
+		// collection which the caller has just created
+#if __has_feature(objc_arc)
+		_objectValue = objectValue ;
+#else
+		_objectValue = [objectValue retain] ;
+#endif
+		_tokenizingCharacter = tokenizingCharacter ;
+		_linkDragType = [linkDragType copy] ;
+		_version = version ;
+	}
+	
+	return self ;
+}
+
+- (void)dealloc {
+#if !__has_feature(objc_arc)
+	[_objectValue release] ;
+	[_linkDragType release] ;
+
+	[super dealloc] ;
+#endif
+}
+
+- (id)objectValue {
+	return _objectValue ;
+}
+
+- (unichar)tokenizingCharacter {
+	return _tokenizingCharacter ;
+}
+
+- (NSString*)linkDragType {
+	return _linkDragType ;
+}
+
+/*!
+ @brief    Incremented each time that objectValue is replaced, but not when
+ only other values are replaced
+*/
+- (unsigned long long)version {
+	return _version ;
+}
+
+- (RPTokenControlSnapshot*)snapshotWithObjectValue:(id)objectValue {
+	// Collections are copied so that no one can mutate them under readers.
+	// State markers are not collections, and are not copyable.
+	if ([objectValue conformsToProtocol:@protocol(NSFastEnumeration)]) {
+		objectValue = [[objectValue copy] autorelease] ;
+	}
+	
+	return [self snapshotWithUnsharedObjectValue:objectValue] ;
+}
+
+/*!
+ @brief    Like -snapshotWithObjectValue:, but adopts the given objectValue
+ without copying it
+
+ @details  Use this to avoid a second copy of a large collection which the
+ caller has just created.  objectValue should be immutable, or, if it is an
+ NSCountedSet, which has no immutable variant, the caller must not mutate
+ it afterward, nor give it to anyone who might.
+*/
+- (RPTokenControlSnapshot*)snapshotWithUnsharedObjectValue:(id)objectValue {
+	RPTokenControlSnapshot* snapshot = [[RPTokenControlSnapshot alloc] initWithObjectValue:objectValue
+																	   tokenizingCharacter:_tokenizingCharacter
+																			  linkDragType:_linkDragType
+																				   version:(_version + 1)] ;
+	return [snapshot autorelease] ;
+}
+
+- (RPTokenControlSnapshot*)snapshotWithTokenizingCharacter:(unichar)tokenizingCharacter {
+	RPTokenControlSnapshot* snapshot = [[RPTokenControlSnapshot alloc] initWithObjectValue:_objectValue
+																	   tokenizingCharacter:tokenizingCharacter
+																			  linkDragType:_linkDragType
+																				   version:_version] ;
+	return [snapshot autorelease] ;
+}
+
+- (RPTokenControlSnapshot*)snapshotWithLinkDragType:(NSString*)linkDragType {
+	RPTokenControlSnapshot* snapshot = [[RPTokenControlSnapshot alloc] initWithObjectValue:_objectValue
+																	   tokenizingCharacter:_tokenizingCharacter
+																			  linkDragType:linkDragType
+																				   version:_version] ;
+	return [snapshot autorelease] ;
+}
+
+@end
+
+
+@interface RPTokenControl () {
+	// Declared here instead of in RPTokenControl.h so that users of
+	// RPTokenControl.h need not import RPSnapshotCell.h.
+	// Holds the current RPTokenControlSnapshot.
+	RPSnapshotCell _snapshotCell ;
+	// Width-independent part of the layout.  See -layoutCore.
+	TokenLayoutCore* _layoutCore ;
+}
+
+@end
+
+
 // Constants for ivars used in -initWithCoder, encodeWithCoder:
 
 NSString*  constKeyAppendCountsToStrings = @"appendCountsToStrings" ;
@@ -555,19 +1068,153 @@ const float minGap = 2.0 ; // Used for both horizontal and vertical gap between
 	return answer ;
 }
 
-- (unichar)tokenizingCharacter {
-	unichar tokenizingCharacter ;
-	@synchronized(self) {
-		tokenizingCharacter = m_tokenizingCharacter ; ;
+#pragma mark * Snapshots
+
+static void* RPRetainSnapshot(void* snapshot) {
+	return (void*)CFRetain(snapshot) ;
+}
+
+static void RPReleaseSnapshot(void* snapshot) {
+	CFRelease(snapshot) ;
+}
+
+- (void)initSnapshotWithTokenizingCharacter:(unichar)tokenizingCharacter
+							   linkDragType:(NSString*)linkDragType {
+	RPTokenControlSnapshot* snapshot = [[RPTokenControlSnapshot alloc] initWithObjectValue:nil
+																	   tokenizingCharacter:tokenizingCharacter
+																			  linkDragType:linkDragType
+																				   version:0] ;
+	RPSnapshotCellInit(&_snapshotCell,
+					   (void*)CFBridgingRetain(snapshot),
+					   RPRetainSnapshot,
+					   RPReleaseSnapshot) ;
+#if !__has_feature(objc_arc)
+	[snapshot release] ;
+#endif
+}
+
+/*!
+ @brief    Returns the current snapshot of the receiver's model state,
+ without locking
+
+ @details  May be invoked on any thread.  See RPSnapshotCell.h.
+*/
+- (RPTokenControlSnapshot*)snapshot {
+	return CFBridgingRelease(RPSnapshotCellCopyCurrent(&_snapshotCell)) ;
+}
+
+/*!
+ @brief    Atomically replaces a given snapshot, which should have been
+ obtained from -snapshot, with a new snapshot
+
+ @details  May be invoked on any thread.  Never waits for readers.
+ @result   YES if successful, NO if the given current snapshot had already
+ been replaced by another thread.  In the latter case, the caller should get
+ the new current snapshot, derive a new snapshot from it, and try again.
+*/
+- (BOOL)replaceSnapshot:(RPTokenControlSnapshot*)current
+		   withSnapshot:(RPTokenControlSnapshot*)newSnapshot {
+	void* desired = (void*)CFBridgingRetain(newSnapshot) ;
+	if (!RPSnapshotCellReplace(&_snapshotCell, (__bridge void*)current, desired)) {
+		CFRelease(desired) ;
+		return NO ;
 	}
-	return tokenizingCharacter ;
+	
+	return YES ;
 }
 
-- (void)setTokenizingCharacter:(unichar)tokenizingCharacter {
-	@synchronized(self) {
-		[self setTokenizingCharacterSet:[NSCharacterSet characterSetWithRange:NSMakeRange(tokenizingCharacter, 1)]] ;
-		m_tokenizingCharacter = tokenizingCharacter ;
+/*!
+ @brief    Silently publishes a new objectValue in which the current
+ tokenBeingEdited is replaced by an immutable copy of a given text, and
+ sets tokenBeingEdited to that copy
+
+ @details  Invoked with each keystroke while the user types in a new token.
+ Since the copy is a new, immutable object, readers on other threads
+ never see characters changing in a token of the collection they read.
+ Does nothing if no token is being edited.  To start editing a new token,
+ use -publishTokenBeingEdited:replacingToken: with a nil oldToken.
+*/
+- (void)publishTokenBeingEdited:(NSString*)text {
+	NSString* oldToken = [self tokenBeingEdited] ;
+	if (!oldToken) {
+		return ;
 	}
+	
+	[self publishTokenBeingEdited:text
+				   replacingToken:oldToken] ;
+}
+
+/*!
+ @brief    Silently publishes a new objectValue in which a given old token,
+ or nothing if it is nil, is replaced by an immutable copy of a given text,
+ and sets tokenBeingEdited to that copy
+*/
+- (void)publishTokenBeingEdited:(NSString*)text
+				 replacingToken:(NSString*)oldToken {
+	NSString* newToken = [[text copy] autorelease] ;
+	RPTokenControlSnapshot* current ;
+	RPTokenControlSnapshot* newSnapshot ;
+	do {
+		current = [self snapshot] ;
+		id objectValue = [current objectValue] ;
+		id newTokens ;
+		if ([objectValue conformsToProtocol:@protocol(NSFastEnumeration)]) {
+			newTokens = [objectValue mutableCopy] ;
+		}
+		else {
+			// Must be a state marker
+			newTokens = [[NSMutableArray alloc] init] ;
+		}
+		
+		if (!oldToken) {
+			[newTokens addObject:newToken] ;
+		}
+		else if ([newTokens isKindOfClass:[NSMutableArray class]]) {
+			NSUInteger index = [newTokens indexOfObjectIdenticalTo:oldToken] ;
+			if (index != NSNotFound) {
+				[newTokens replaceObjectAtIndex:index
+									 withObject:newToken] ;
+			}
+			else {
+				[newTokens addObject:newToken] ;
+			}
+		}
+		else {
+			// We added oldToken once, so we remove it once.  But if a set
+			// already contained a string equal to oldToken, adding did nothing,
+			// and that string, not being ours, must stay.
+			if (
+				[newTokens isKindOfClass:[NSCountedSet class]]
+				|| ([newTokens member:oldToken] == oldToken)
+				) {
+				[newTokens removeObject:oldToken] ;
+			}
+			[newTokens addObject:newToken] ;
+		}
+		
+		newSnapshot = [current snapshotWithObjectValue:newTokens] ;
+#if !__has_feature(objc_arc)
+		[newTokens release];
+#endif
+	} while (![self replaceSnapshot:current
+					   withSnapshot:newSnapshot]) ;
+	
+	[self setTokenBeingEdited:newToken] ;
+}
+
+#pragma mark * Accessors (continued)
+
+- (unichar)tokenizingCharacter {
+	return [[self snapshot] tokenizingCharacter] ;
+}
+
+- (void)setTokenizingCharacter:(unichar)tokenizingCharacter {
+	[self setTokenizingCharacterSet:[NSCharacterSet characterSetWithRange:NSMakeRange(tokenizingCharacter, 1)]] ;
+	RPTokenControlSnapshot* current ;
+	do {
+		current = [self snapshot] ;
+	} while (![self replaceSnapshot:current
+					   withSnapshot:[current snapshotWithTokenizingCharacter:tokenizingCharacter]]) ;
 }
 
 + (NSSet*)keyPathsForValuesAffectingTokenizingCharacterSet {
@@ -583,14 +1230,10 @@ const float minGap = 2.0 ; // Used for both horizontal and vertical gap between
 }
 
 - (id)objectValue {
-	id objectValue ;
-	@synchronized(self) {
-        objectValue = m_objectValue;
+	id objectValue = [[self snapshot] objectValue] ;
 #if !__has_feature(objc_arc)
-        [m_objectValue retain];
-        [m_objectValue autorelease] ;
+	[[objectValue retain] autorelease] ;
 #endif
-	}
 	return objectValue ;
 }
 
@@ -599,18 +1242,23 @@ const float minGap = 2.0 ; // Used for both horizontal and vertical gap between
 		newTokens = SSYNoTokensMarker ;
 	}
 	
-	BOOL isPlaceholder = ([newTokens extractStrings] == nil) ;
+	NSSet* newStrings = [newTokens extractStrings] ;
+	BOOL isPlaceholder = (newStrings == nil) ;
 	
-	BOOL substantiveChange ;
-	id oldTokens ;
-	
-	@synchronized(self) {
-		BOOL wasPlaceholder = ([m_objectValue extractStrings] == nil) ;
-
+	BOOL didNotifyWillChange = NO ;
+	RPTokenControlSnapshot* current ;
+	RPTokenControlSnapshot* newSnapshot ;
+	do {
+		current = [self snapshot] ;
+		id oldTokens = [current objectValue] ;
+		NSSet* oldStrings = [oldTokens extractStrings] ;
+		BOOL wasPlaceholder = (oldStrings == nil) ;
+		
+		BOOL substantiveChange ;
 		if (isPlaceholder) {
 			if (wasPlaceholder) {
 				// is and was a placeholder
-				substantiveChange = (newTokens != m_objectValue) ;
+				substantiveChange = (newTokens != oldTokens) ;
 			}
 			else {
 				substantiveChange = YES ;
@@ -621,47 +1269,64 @@ const float minGap = 2.0 ; // Used for both horizontal and vertical gap between
 		}
 		else {
 			// is not and was not a placeholder
-			substantiveChange = (
-								 ((m_objectValue == nil) && (newTokens != nil))
-								 ||
-								 (![[m_objectValue extractStrings] isEqual:[newTokens extractStrings]])
-								 ) ;	
-		}			
+			substantiveChange = ![oldStrings isEqual:newStrings] ;
+		}
 		
 		// If only some count(s) changed, but the strings remained the
 		// same, we can keep the selection and layout, and do not trigger KVO
-#if !__has_feature(objc_arc)
-		[newTokens retain] ;
-#endif
-        if (substantiveChange) {
-			[self willChangeValueForKey:@"objectValue"];
+		if (substantiveChange && !didNotifyWillChange) {
+			[self willChangeValueForKey:@"objectValue"] ;
+			didNotifyWillChange = YES ;
 		}
 		
-		// Since oldTokens will be passed to the observer by
-		// will/didChangeValueForKey, we can't release it until
-		// after the notification has executed.  But, we'll
-		// need a reference to do that.  So we now make
-		// that reference:
-		oldTokens = m_objectValue ;
-		// before we change it:
-		m_objectValue = newTokens ;
+		newSnapshot = [current snapshotWithObjectValue:newTokens] ;
+		// The old tokens, which KVO may pass to observers, stay alive until
+		// after didChangeValueForKey: because current is autoreleased.
+	} while (![self replaceSnapshot:current
+					   withSnapshot:newSnapshot]) ;
+	
+	// If another thread replaced objectValue while we were comparing, we may
+	// have notified willChange for what turned out to be an insubstantive
+	// change on retry.  We treat it as substantive, to balance KVO.
+	BOOL substantiveChange = didNotifyWillChange ;
+	if (substantiveChange) {
+		[self didChangeValueForKey:@"objectValue"] ;
 	}
 	
-    if (substantiveChange) {
-		[self didChangeValueForKey:@"objectValue"];
+	unsigned long long version = [newSnapshot version] ;
+	if ([NSThread isMainThread]) {
+		[self updateForObjectValueVersion:version
+						substantiveChange:substantiveChange] ;
 	}
-#if !__has_feature(objc_arc)
-    // Now it is safe to do this:
-	[oldTokens release];
-#endif
-	
+	else {
+		// Selection, layout and drawing may only be touched on the main
+		// thread.  Instead of making this writer wait for that, we schedule it.
+		dispatch_async(dispatch_get_main_queue(), ^{
+			[self updateForObjectValueVersion:version
+							substantiveChange:substantiveChange] ;
+		}) ;
+	}
+}
+
+/*!
+ @brief    Updates the selection and layout after objectValue has been
+ replaced by a given version
+
+ @details  Must be invoked on the main thread.
+*/
+- (void)updateForObjectValueVersion:(unsigned long long)version
+				  substantiveChange:(BOOL)substantiveChange {
 	if (substantiveChange) {
 		// String(s) changed
 		[self deselectAllIndexes] ;
-	}	
+	}
 	
-	[self invalidateLayout] ;
-	[self setTokenBeingEdited:nil] ;
+	// If objectValue has been replaced again since the given version, the
+	// update for the replacement will lay out the newer tokens.
+	if ([[self snapshot] version] == version) {
+		[self invalidateLayout] ;
+		[self setTokenBeingEdited:nil] ;
+	}
 }
 
 - (id)value {
@@ -680,29 +1345,26 @@ const float minGap = 2.0 ; // Used for both horizontal and vertical gap between
 }
 
 - (NSString*)linkDragType {
-	NSString* linkDragType ;
-	@synchronized(self) {
-		linkDragType = [[_linkDragType copy] autorelease] ; ;
-	}
+	NSString* linkDragType = [[self snapshot] linkDragType] ;
+#if !__has_feature(objc_arc)
+	[[linkDragType retain] autorelease] ;
+#endif
 	return linkDragType ;
 }
 
 - (void)setLinkDragType:(NSString *)newLinkDragType {
-#if !__has_feature(objc_arc)
-    [newLinkDragType retain] ;
-#endif
-    @synchronized(self) {
-#if !__has_feature(objc_arc)
-		[_linkDragType release];
-#endif
-		_linkDragType = newLinkDragType ;
-		if (_linkDragType != nil) {
-			[self registerForDraggedTypes:[NSArray arrayWithObject:_linkDragType]] ;
-		}
-		else {
-			[self unregisterDraggedTypes] ;
-			[self registerForDefaultDraggedTypes] ;
-		}
+	RPTokenControlSnapshot* current ;
+	do {
+		current = [self snapshot] ;
+	} while (![self replaceSnapshot:current
+					   withSnapshot:[current snapshotWithLinkDragType:newLinkDragType]]) ;
+	
+	if (newLinkDragType != nil) {
+		[self registerForDraggedTypes:[NSArray arrayWithObject:newLinkDragType]] ;
+	}
+	else {
+		[self unregisterDraggedTypes] ;
+		[self registerForDefaultDraggedTypes] ;
 	}
 }
 
@@ -723,6 +1385,47 @@ const float minGap = 2.0 ; // Used for both horizontal and vertical gap between
 	return _textField ;
 }
 
+- (RPTokenLayoutContext*)layoutContext {
+	if (_layoutContext == nil) {
+		// Private to the receiver, so measures text at exact font sizes
+		_layoutContext = [[RPTokenLayoutContext alloc] initForSharing:NO] ;
+	}
+	
+	return _layoutContext ;
+}
+
+- (void)setLayoutContext:(RPTokenLayoutContext*)layoutContext {
+	if (layoutContext != _layoutContext) {
+#if !__has_feature(objc_arc)
+		[layoutContext retain] ;
+		[_layoutContext release] ;
+#endif
+		_layoutContext = layoutContext ;
+		[self invalidateLayout] ;
+	}
+}
+
+- (BOOL)isCellStyle {
+	return _cellStyle ;
+}
+
+- (void)setCellStyle:(BOOL)cellStyle {
+	_cellStyle = cellStyle ;
+	if (cellStyle && (_textField != nil)) {
+		// A cell cannot edit, so finish any editing and remove the text
+		// field, so that it is not left over the tokens.
+		[self controlTextDidEndEditing:[NSNotification notificationWithName:@"RPTokenControlSetCellStyle"
+																	 object:nil]] ;
+		[_textField setDelegate:nil] ;
+		[_textField removeFromSuperview] ;
+#if !__has_feature(objc_arc)
+		[_textField release] ;
+#endif
+		_textField = nil ;
+	}
+	[self invalidateLayout] ;
+}
+
 #pragma mark * Layout
 
 const float halfRingWidth = 2.0 ;
@@ -756,20 +1459,50 @@ const float halfRingWidth = 2.0 ;
 	}
 }
 
-- (void)doLayout {
-	if(_framedTokens != nil) {
-		return ;
+- (FramedToken*)framedTokenForToken:(RPCountedToken*)token
+				 fontSizesForCounts:(NSDictionary*)fontSizesForCounts
+					  layoutContext:(RPTokenLayoutContext*)layoutContext {
+	float fontSize = [self fontSizeForToken:token
+							 fromDictionary:fontSizesForCounts] ;
+	NSSize framedTokenSize = [FramedToken boxSizeForToken:token
+												 fontSize:fontSize
+                                       cornerRadiusFactor:_cornerRadiusFactor
+                                   widthPaddingMultiplier:_widthPaddingMultiplier
+											  appendCount:_appendCountsToStrings
+											layoutContext:layoutContext] ;
+	FramedToken *framedToken = [[FramedToken alloc] initWithCountedToken:token
+																fontsize:fontSize
+																  bounds:NSMakeRect(0, 0, framedTokenSize.width, framedTokenSize.height)];
+	return [framedToken autorelease] ;
+}
+
+/*!
+ @brief    Returns the width-independent part of the receiver's layout,
+ computing it if necessary, or nil if objectValue is not a collection
+
+ @details  The layout core depends on objectValue and on the font and padding
+ settings, but not on the receiver's frame.  So when only the frame changes,
+ only -doLayout (line breaking) needs to be redone, not this.
+*/
+- (TokenLayoutCore*)layoutCore {
+	if (_layoutCore != nil) {
+		return _layoutCore ;
 	}
-	_framedTokens = [[NSMutableArray alloc] init];
 	
-	id tokens = [self tokensCollection] ;
-	if (!tokens) {
-		return ;
+	// Like -tokensCollection, but we also need the version of the snapshot
+	RPTokenControlSnapshot* snapshot = [self snapshot] ;
+	id tokens = [snapshot objectValue] ;
+	if (![tokens respondsToSelector:@selector(count)]) {
+		// Must be a state marker
+		return nil ;
 	}
 	
 	//order by occurance and get the top n
 	NSInteger len = [(NSSet*)tokens count];
 	
+	// All token texts go through layoutContext, which may be shared with other
+	// RPTokenControls, so that equal texts are represented by one string object.
+	RPTokenLayoutContext* layoutContext = [self layoutContext] ;
 	NSMutableArray* myTokens = [[NSMutableArray alloc] init] ;
 	NSEnumerator* e = [(NSSet*)tokens objectEnumerator] ;
 	RPCountedToken* token ;
@@ -784,7 +1517,10 @@ const float halfRingWidth = 2.0 ;
 			// be 0, if it exists in the set???  So, I fix that with this line:
 			targetCount = MAX(targetCount, 1) ;
 
-			token = [[RPCountedToken alloc] initWithText:object
+			// Do not intern the token being edited, since it changes with
+			// each keystroke, and we identify it by pointer
+			NSString* text = (object == [self tokenBeingEdited]) ? object : [layoutContext internedString:object] ;
+			token = [[RPCountedToken alloc] initWithText:text
 												   count:targetCount] ;
 			[myTokens addObject:token] ;
 #if !__has_feature(objc_arc)
@@ -801,7 +1537,8 @@ const float halfRingWidth = 2.0 ;
 		while ((object = [e nextObject])) {
 			if (![object isKindOfClass:[RPCountedToken class]]) {
 				// object must be a string (or results are undefined!)
-				token = [[RPCountedToken alloc] initWithText:object
+				NSString* text = (object == [self tokenBeingEdited]) ? object : [layoutContext internedString:object] ;
+				token = [[RPCountedToken alloc] initWithText:text
 													   count:1] ;
 				[myTokens addObject:token] ;
 #if !__has_feature(objc_arc)
@@ -870,203 +1607,153 @@ const float halfRingWidth = 2.0 ;
 	// Sort sortedTokens further, by their text this time
 	sortedTokens = [sortedTokens sortedArrayUsingSelector:@selector(textCompare:)] ;
 	
-	// Format tokens
+	// Measure tokens.  Their origins will be set by -doLayout.
+	NSMutableArray* framedTokens = [[NSMutableArray alloc] initWithCapacity:[sortedTokens count]] ;
+	NSInteger indexOfTokenBeingEdited = NSNotFound ;
+	for (RPCountedToken* sortedToken in sortedTokens) {
+		if (sortedToken == countedTokenEditing) {
+			indexOfTokenBeingEdited = [framedTokens count] ;
+		}
+		[framedTokens addObject:[self framedTokenForToken:sortedToken
+									   fontSizesForCounts:fontSizesForCounts
+											layoutContext:layoutContext]] ;
+	}
+	// In case we need to truncate
+	FramedToken* ellipsisFramedToken = [self framedTokenForToken:[RPCountedToken ellipsisToken]
+											  fontSizesForCounts:fontSizesForCounts
+												   layoutContext:layoutContext] ;
+#if !__has_feature(objc_arc)
+	[fontSizesForCounts release];
+#endif
+	
+	_layoutCore = [[TokenLayoutCore alloc] initWithFramedTokens:framedTokens
+											ellipsisFramedToken:ellipsisFramedToken
+										indexOfTokenBeingEdited:indexOfTokenBeingEdited
+											 objectValueVersion:[snapshot version]
+															gap:minGap] ;
+#if !__has_feature(objc_arc)
+	[framedTokens release];
+#endif
+	
+	return _layoutCore ;
+}
+
+- (void)doLayout {
+	if(_framedTokens != nil) {
+		return ;
+	}
+	_framedTokens = [[NSMutableArray alloc] init];
+	
+	TokenLayoutCore* layoutCore = [self layoutCore] ;
+	if (!layoutCore) {
+		return ;
+	}
+	
+	// Format tokens.  Only the line breaks and line heights depend on our
+	// width, and layoutCore caches them for recently used widths.
+	NSArray* coreTokens = [layoutCore framedTokens] ;
+	NSInteger nTokens = [coreTokens count] ;
 	float wholeWidth = [self frame].size.width ;
+	NSData* linesData = [layoutCore linesForWidth:wholeWidth] ;
+	const TokenLayoutLine* lines = [linesData bytes] ;
+	NSInteger nLines = [linesData length] / sizeof(TokenLayoutLine) ;
 	float maxHeight = 0.0 ;
-	NSPoint pt = NSMakePoint(0.0, minGap) ;
+	float y = minGap ;
 	// minGap here is to leave a little whitespace (or blackspace, as the case may be)
 	// between the top of the view and the top of the first row of tokens
-	e = [sortedTokens objectEnumerator];	
-	id currentToken;
-	NSMutableArray *currentLine = [[NSMutableArray alloc] init] ;
-	// We would like to lay out each line of tokens as it is completed,
-	// however we cannot quite do this because:
-	//   (1) the last line is to be left-aligned instead of justified (spread).
-	//   (2) If we have no enclosing scroll view the "last" line may have to be
-	//     eliminated (truncated off) if it does not fit.
-	//   (3) We don't know that until we find out how high its highest token is (maxHeight).
-	// So, because of all this we have to store information about the
-	// "previous" line, and wait until the end to lay out the last
-	// line (which will be the currentLine) and the second-last line
-	// (which will be the previousLine.
-	NSArray* previousLine = nil ;
-	float previousLineTokensWidth ;
-	float previousLineY ;
-	float previousLineMaxHeight ;
-	NSScrollView* scrollView = [self enclosingScrollView] ;
+	// In cell style, any enclosing scroll view is not ours; it is the table's.
+	NSScrollView* scrollView = _cellStyle ? nil : [self enclosingScrollView] ;
 	NSRect frame = [self frame] ;
 	NSMutableArray* truncatedTokens = [self truncatedTokens] ;
 	[truncatedTokens removeAllObjects] ;
 	
-	NSInteger i = 0 ;
-	BOOL focusRingLeftOfFirstToken = NO ;
-	_indexOfFramedTokenBeingEdited = NSNotFound ;
-	while (currentToken = [e nextObject]) {
-		float fontSize = [self fontSizeForToken:currentToken
-								 fromDictionary:fontSizesForCounts] ;
-		NSSize framedTokenSize = [FramedToken boxSizeForToken:currentToken
-													 fontSize:fontSize
-                                           cornerRadiusFactor:_cornerRadiusFactor
-                                       widthPaddingMultiplier:_widthPaddingMultiplier
-												  appendCount:_appendCountsToStrings] ;
-		
-		// If the first token is being edited, provide a little extra margin on the left
-		// for the focus ring, because _textField will be set to a frame which is 
-		// based on the frame of the FramedToken we are about to create.
-		if ((i==0) && (currentToken == countedTokenEditing)) {
-			focusRingLeftOfFirstToken = YES ;
+	// If the first token is being edited, provide a little extra margin on the left
+	// for the focus ring, because _textField will be set to a frame which is 
+	// based on the frame of the FramedToken being edited.
+	BOOL focusRingLeftOfFirstToken = ([layoutCore indexOfTokenBeingEdited] == 0) ;
+	NSInteger nLaidOutTokens = 0 ;
+	NSInteger line ;
+	for (line=0; line<nLines; line++) {
+		NSInteger start = lines[line].start ;
+		NSInteger end = (line < nLines - 1) ? lines[line+1].start : nTokens ;
+		BOOL isLastLine = (line == nLines - 1) ;
+		if (line > 0) {
+			// Note that this view uses a flipped y coordinate.
+			// That makes it easier because now we can simply
+			// increase y to move the next line down...
+			y += maxHeight + minGap ;
+			// ... and no need to displace any of the previous lines.
 		}
+		maxHeight = lines[line].height ;
 		
-		if((pt.x+minGap+framedTokenSize.width > wholeWidth) && (pt.x > 0)) {
-			// Horizontal overflow.  Put the currentToken on 'hold'.  It will
-			// go into the ^next^ line.  Now, we do several finalization tasks
-			// on the current line and the previous line...
-			
-			// Before dealing with the current line, we see if there was a 
-			// ^previous^ line that needs to be finalized.
-			if (previousLine) {
-				// Since we have now overflowed into a ^new^ line, we know that
-				// the ^previous^ line is ^not^ the last line, therefore we are 
-				// now certain that it should be laid out with justification (spreading).
-				// We now do that, adding the FramedTokens from previousLine, with
-				// layout information, to _framedTokens.
-				// The 'gap' is the amount of space between tokens.
-				// In this case it is calculated to justify or "spread" the tokens.
-				NSInteger nGaps = [previousLine count] - 1 ;
-				float extraWidth = wholeWidth - previousLineTokensWidth ;
-				float gap = minGap + extraWidth/nGaps ;
-				[self layoutLine:previousLine
-							   y:previousLineY
-							   h:previousLineMaxHeight
-							 gap:gap
-				  focusRingFirst:focusRingLeftOfFirstToken] ;
-				focusRingLeftOfFirstToken = NO ;
-				[_framedTokens addObjectsFromArray:previousLine];
+		// If superview does not scroll, see if we can fit more lines.
+		// As always, the last line is allowed to overflow.
+		if (!isLastLine && (scrollView == nil) && (y + maxHeight > frame.size.height)) {
+			// Vertical overflow in a non-scrolling view.  This line will be the
+			// last line displayed, ending with an ellipsisToken instead of the
+			// tokens which did not fit.  See if the ellipsisToken fits, and if
+			// not, remove tokens from the end of this line until it does fit.
+			FramedToken* ellipsisFramedToken = [layoutCore ellipsisFramedToken] ;
+			float ellipsisWidth = [ellipsisFramedToken bounds].size.width ;
+			NSInteger fittingEnd = end ;
+			while (
+				   (fittingEnd > start)
+				   && ([layoutCore widthOfTokensInRange:NSMakeRange(start, fittingEnd - start)] + minGap + ellipsisWidth > wholeWidth)
+				   ) {
+				fittingEnd-- ;
 			}
 			
-			// If superview does not scroll, see if we can fit more tokens
-			if ((scrollView==nil) && (pt.y + maxHeight > frame.size.height)) {
-				// Vertical overflow in a non-scrolling view
-				
-				// Replace the proposed currentToken (which caused an overflow)
-				// with an ellipsisToken
-				[truncatedTokens addObject:currentToken] ;
-				currentToken = [RPCountedToken ellipsisToken] ;
-				fontSize = [self fontSizeForToken:currentToken
-								   fromDictionary:fontSizesForCounts] ;
-				
-				framedTokenSize = [FramedToken boxSizeForToken:currentToken
-													  fontSize:fontSize
-                                            cornerRadiusFactor:_cornerRadiusFactor
-                                        widthPaddingMultiplier:_widthPaddingMultiplier
-												   appendCount:_appendCountsToStrings] ;
-				
-				// See if it fits now, and if not, remove tokens previously added
-				// to currentLine until it does fit.
-				while (pt.x+minGap+framedTokenSize.width > wholeWidth) {
-					FramedToken* tokenToRemove = [currentLine lastObject] ;
-					float reclaimedWidth = [tokenToRemove bounds].size.width + minGap ;
-					if ([currentLine count] < 1) {
-						// Should never happen but I'm not sure
-						NSLog(@"Internal Error 638-4882") ;
-						break ;
-					}
-					[currentLine removeLastObject] ;
-					pt.x -= reclaimedWidth ;
-				}
-				
-				// Add the ellipsisToken (now currentToken)
-				FramedToken *framedToken = [[FramedToken alloc] initWithCountedToken:currentToken
-																			fontsize:fontSize
-																			  bounds:NSMakeRect(0, 0, framedTokenSize.width, framedTokenSize.height)];
-				[currentLine addObject:framedToken] ;
-#if !__has_feature(objc_arc)
-				[framedToken release];
-#endif
-				
-				break ;
+			NSInteger i ;
+			for (i=fittingEnd; i<nTokens; i++) {
+				[truncatedTokens addObject:[[coreTokens objectAtIndex:i] token]] ;
 			}
 			
-			previousLine = [[currentLine copy] autorelease] ;
-			previousLineTokensWidth = pt.x ;
-			previousLineY = pt.y ;
-			previousLineMaxHeight = maxHeight ;
-			// Clear everything out in preparation for next line
-			float currentLineHeight = maxHeight + minGap ;
-			// Note that this view uses a flipped y coordinate.
-			// That makes it easier because now we can simply
-			// increase y to move the next line down...
-			pt.y += currentLineHeight ;
-			// ... and no need to displace any of the previous lines.
-			[currentLine removeAllObjects];
-			maxHeight = 0.0;
-			pt.x = 0;
-		}
-		FramedToken *framedToken = [[FramedToken alloc] initWithCountedToken:currentToken
-																	fontsize:fontSize
-																	  bounds:NSMakeRect(0, 0, framedTokenSize.width, framedTokenSize.height)];
-		[currentLine addObject:framedToken] ;
+			// Like any last line, it is left-aligned, so gap = minGap
+			NSMutableArray* lastLine = [[coreTokens subarrayWithRange:NSMakeRange(start, fittingEnd - start)] mutableCopy] ;
+			[lastLine addObject:ellipsisFramedToken] ;
+			[self layoutLine:lastLine
+						   y:y
+						   h:maxHeight
+						 gap:minGap
+			  focusRingFirst:(focusRingLeftOfFirstToken && (line == 0))] ;
+			[_framedTokens addObjectsFromArray:lastLine] ;
 #if !__has_feature(objc_arc)
-		[framedToken release];
+			[lastLine release];
 #endif
-		
-		if(pt.x > 0) {
-			pt.x += minGap ;
+			nLaidOutTokens = fittingEnd ;
+			break ;
 		}
-		pt.x += framedTokenSize.width;
 		
-		if(framedTokenSize.height > maxHeight) {
-			maxHeight = framedTokenSize.height ;
+		// gap is the amount of space between tokens.
+		float gap ;
+		NSInteger nGaps = end - start - 1 ;
+		if (isLastLine || (nGaps < 1)) {
+			// The last line is different because it is left-aligned instead
+			// of justified.  So, we use gap = minGap
+			gap = minGap ;
 		}
-		
-		if (currentToken == countedTokenEditing) {
-			_indexOfFramedTokenBeingEdited = i ;
+		else {
+			// We know that this line is ^not^ the last line, so it should be
+			// justified.  The gap is calculated to "spread" the tokens.
+			float extraWidth = wholeWidth - [layoutCore widthOfTokensInRange:NSMakeRange(start, end - start)] ;
+			gap = minGap + extraWidth/nGaps ;
 		}
-		i++ ;
-	}
-
-#if !__has_feature(objc_arc)
-	[fontSizesForCounts release];
-#endif
-	
-	// Add any remaining tokens (which did not fit) to truncatedTokens
-	while (currentToken = [e nextObject]) {
-		[truncatedTokens addObject:currentToken] ;
-	}
-	
-	// Lay out the second-last line.
-	if ([previousLine count] > 0) {
-		// gap is the amount of space between tokens.
-		// In this case it is calculated for each line to justify or "spread" the tokens.
-		NSInteger nGaps = [previousLine count] - 1 ;
-		float extraWidth = wholeWidth - previousLineTokensWidth ;
-		float gap = minGap + extraWidth/nGaps ;
-		[self layoutLine:previousLine
-					   y:previousLineY
-					   h:previousLineMaxHeight
+		NSArray* lineTokens = [coreTokens subarrayWithRange:NSMakeRange(start, end - start)] ;
+		[self layoutLine:lineTokens
+					   y:y
+					   h:maxHeight
 					 gap:gap
-		  focusRingFirst:focusRingLeftOfFirstToken] ;
-		focusRingLeftOfFirstToken = NO ;
-		[_framedTokens addObjectsFromArray:previousLine];
+		  focusRingFirst:(focusRingLeftOfFirstToken && (line == 0))] ;
+		[_framedTokens addObjectsFromArray:lineTokens] ;
+		nLaidOutTokens = end ;
 	}
 	
-	// Lay out the last line.
-	// This one is different because it is left-aligned instead of justified.
-	// So, we use gap = minGap
-	if ([currentLine count] > 0) {
-		[self layoutLine:currentLine
-					   y:pt.y
-					   h:maxHeight
-					 gap:minGap
-		  focusRingFirst:focusRingLeftOfFirstToken] ;			
-	}
-	[_framedTokens addObjectsFromArray:currentLine] ;
-#if !__has_feature(objc_arc)
-	[currentLine release];
-#endif
+	// If the token being edited overflowed, it is not being drawn
+	NSInteger indexOfTokenBeingEdited = [layoutCore indexOfTokenBeingEdited] ;
+	_indexOfFramedTokenBeingEdited = (indexOfTokenBeingEdited < nLaidOutTokens) ? indexOfTokenBeingEdited : NSNotFound ;
 	
 	// If in a scroll view, increase heght and add scroller if needed
-	float requiredHeight = pt.y + maxHeight ;
+	float requiredHeight = y + maxHeight ;
 	float scrollViewHeight = scrollView ? [scrollView frame].size.height : 0.0 ;
 	// Must set the lockout here because -setHasVerticalScroller can invoke our -setFrameSize
 	_isDoingLayout = YES ;
@@ -1092,7 +1779,18 @@ const float halfRingWidth = 2.0 ;
 	[self setFrameSize:frame.size] ;
 	_isDoingLayout = NO ;
 	
-	
+	[self updateToolTipRects] ;
+}
+
+/*!
+ @brief    Replaces the toolTip rects of the receiver with one for each
+ token as now laid out
+
+ @details  During live resize, only removes them, because adding a rect for
+ each of thousands of tokens in each pass would make resizing jerky.  They
+ are added when live resize ends.
+*/
+- (void)updateToolTipRects {
 	// Remove old toolTips
 	// Remember this, because, -removeAllToolTips removes both
 	// the view-wide toolTip and the rect toolTips.
@@ -1108,9 +1806,9 @@ const float halfRingWidth = 2.0 ;
 		[wholeViewToolTip release];
 #endif
 	}
-	// Add new toolTip rects
-	{
-		e = [_framedTokens objectEnumerator] ;
+	// Add new toolTip rects, unless we are one of perhaps hundreds of cells
+	if (!_cellStyle && ![self inLiveResize]) {
+		NSEnumerator* e = [_framedTokens objectEnumerator] ;
 		FramedToken *framedToken ;
 		while(framedToken = [e nextObject]) {
 			[self addToolTipRect:[framedToken bounds]
@@ -1120,7 +1818,28 @@ const float halfRingWidth = 2.0 ;
 	}
 }
 
+/*!
+ @brief    Recalculates the receiver's layout from scratch, and marks the
+ receiver as needing display
+
+ @details  Must be invoked whenever the tokens, or anything affecting their
+ sizes, change.
+*/
 - (void)invalidateLayout {
+#if !__has_feature(objc_arc)
+	[_layoutCore release];
+#endif
+	_layoutCore = nil ;
+	[self invalidateLineBreaks] ;
+}
+
+/*!
+ @brief    Breaks the already-measured tokens into lines again, and marks the
+ receiver as needing display
+
+ @details  Sufficient when only the receiver's frame has changed.
+*/
+- (void)invalidateLineBreaks {
 #if !__has_feature(objc_arc)
 	[_framedTokens release];
 #endif
@@ -1362,9 +2081,11 @@ const float halfRingWidth = 2.0 ;
 }
 
 - (void)setFrameSize:(NSSize)size {
+	NSSize oldSize = [self frame].size ;
 	[super setFrameSize:size];
-	if (!_isDoingLayout) {
-		[self invalidateLayout] ;
+	if (!_isDoingLayout && !NSEqualSizes(size, oldSize)) {
+		// Token sizes do not depend on our frame, so only line breaks need redoing
+		[self invalidateLineBreaks] ;
 	}
 	
 }
@@ -1432,31 +2153,20 @@ const float halfRingWidth = 2.0 ;
 }	
 
 - (void)beginEditingNewTokenWithString:(NSString*)string {
-	// Ordinarily, string is one character, the first character typed.
-	id newTokens ;
-	if ([m_objectValue respondsToSelector:@selector(mutableCopy)]) {
-		newTokens = [m_objectValue mutableCopy] ;
-	}
-	else {
-		newTokens = [[NSMutableArray alloc] init] ;
+	if (_cellStyle) {
+		// Cells do not have a text field subview to type into
+		NSBeep() ;
+		return ;
 	}
-
-	NSMutableString* mutableString = [string mutableCopy] ;
-	[newTokens addObject:mutableString] ;
-	[self setTokenBeingEdited:mutableString] ;
-#if !__has_feature(objc_arc)
-	[mutableString release];
-#endif
-	// We set the ivar directly here to avoid triggering KVO
-#if !__has_feature(objc_arc)
-	[m_objectValue release];
-#endif
-	m_objectValue = newTokens ;
+	
+	// Ordinarily, string is one character, the first character typed.
+	[self publishTokenBeingEdited:string
+				   replacingToken:nil] ;
 	[self deselectAllIndexes] ;
 	[self invalidateLayout] ;
 	
 	NSTextField* textField = [self textField] ;
-	[textField setStringValue:mutableString] ;
+	[textField setStringValue:string] ;
 	[[self window] makeFirstResponder:textField] ;
 	// The next step is to deselect the text (one character) and
 	// move the insertion point to the end.  NSTextField does not
@@ -1485,6 +2195,9 @@ const float halfRingWidth = 2.0 ;
 			[textField setStringValue:[newText substringToIndex:lastIndex]] ;
 			[self controlTextDidEndEditing:[NSNotification notificationWithName:@"RPTokenControlTextDidChange"
                                                                          object:nil]] ;
+			// The token, without the tokenizing character, was published with
+			// the previous keystroke, and editing has ended, so we are done.
+			return ;
 		}
 	}
 
@@ -1503,7 +2216,7 @@ const float halfRingWidth = 2.0 ;
 			NSBeep() ;	
 		}
 	}
-	[[self tokenBeingEdited] setString:newText] ;
+	[self publishTokenBeingEdited:newText] ;
 	[self invalidateLayout] ;
 	[self updateTextFieldFrame] ;
 }
@@ -1513,38 +2226,34 @@ const float halfRingWidth = 2.0 ;
 	[textField setHidden:YES] ;
 	
 	// Finalize this token:
-	// Make the new token immutable and trigger automatic KVO for observers of tokens.
-	id tokens = [self tokensCollection] ;
-	if (!tokens) {
+	// The new token is already in objectValue, published silently with each
+	// keystroke.  Now we trigger KVO for observers of tokens.
+	if (![self tokensCollection]) {
 		return ;
 	}
 	
-	NSString* tokenEditing = [self tokenBeingEdited] ;
 	// This method seems to get invoked when you just click on the field.
 	// Not sure why.  It's Cocoa.
-	// Exceptions will be raised in what follows if tokenEditing == nil,
-	// so we guard against that
-	if (!tokenEditing) {
+	if (![self tokenBeingEdited]) {
 		return ;
 	}
-
-	[tokens removeObject:tokenEditing] ;
-	NSString* newToken = [tokenEditing copy] ;
-	[tokens addObject:newToken] ;
-#if !__has_feature(objc_arc)
-	[newToken release];
-#endif
-#if !__has_feature(objc_arc)
-	[m_objectValue release];
-#endif
-    // Next line is so that substantiveChange will be detected
-	m_objectValue = nil ;
-	// Now, we trigger KVO
-	[self setObjectValue:tokens] ;
-	// The following line was commented out in BookMacster 1.11.6.
-	// I can't figure out why the hell it was in there, but I see no need
-	// for it, and indeed it causes a crash.
-	//	[tokens release] ;  // Note 20120629
+	
+	// We know that this is a substantive change, since the new token was
+	// published silently.  So, instead of -setObjectValue:, which would find
+	// no change, we republish the current tokens as a new version, without
+	// ever publishing any intermediate objectValue.
+	[self willChangeValueForKey:@"objectValue"] ;
+	RPTokenControlSnapshot* current ;
+	RPTokenControlSnapshot* newSnapshot ;
+	do {
+		current = [self snapshot] ;
+		// The objectValue of a snapshot is already immutable
+		newSnapshot = [current snapshotWithUnsharedObjectValue:[current objectValue]] ;
+	} while (![self replaceSnapshot:current
+					   withSnapshot:newSnapshot]) ;
+	[self didChangeValueForKey:@"objectValue"] ;
+	[self updateForObjectValueVersion:[newSnapshot version]
+					substantiveChange:YES] ;
 	[[self window] makeFirstResponder:self] ;
 }
 
@@ -1749,70 +2458,122 @@ const float halfRingWidth = 2.0 ;
  Returns YES if any tokens were selected and deleted
  */
 - (BOOL)deleteSelectedTokens {
-    BOOL didDelete = NO ;
-    if ([[self selectedIndexSet] count] > 0) {
-        // Get the tokensToDelete from _framedTokens and selectedIndexSet
-        NSArray* framedTokensToDelete = [_framedTokens objectsAtIndexes:[self selectedIndexSet]] ;
-        NSArray* stringsToDelete = [framedTokensToDelete valueForKey:@"text"] ;
-        NSMutableSet* tokensToDelete = nil ;
-        if ([self tokensSet]) {
-            tokensToDelete = [[self tokensSet] mutableCopy] ;
-            [tokensToDelete intersectSet:[NSSet setWithArray:stringsToDelete]] ;
-            
-            // Remove the tokensToDelete from m_tokens
-            id tokens = [self tokensCollection] ;
-            if (tokens) {
-                id newTokens = [tokens mutableCopy] ;
-                // Missing colon after removeObjectsInArray in next line was
-                // added in BookMacster 1.17.
-                if ([tokens respondsToSelector:@selector(removeObjectsInArray:)]) {
-                    // Must be an NSMutableArray
-                    [newTokens removeObjectsInArray:[tokensToDelete allObjects]] ;
-                }
-                else if ([newTokens respondsToSelector:@selector(minusSet:)]) {
-                    // Must be an NSMutableSet
-                    // I tried [newTokens minusSet:tokensToDelete] here.  But
-                    // the effect of that is to only reduce the count of the
-                    // target token by 1.  The following is needed to reduce
-                    // the count to 0 and eliminate it entirely…
-                    for (NSString* string in tokensToDelete) {
-                        NSInteger nToRemove = [newTokens countForObject:string] ;
-                        for (NSInteger i=0; i<nToRemove; i++) {
-                            [newTokens removeObject:string] ;
-                        }
-                    }
-                }
-                
-                NSSet* deletedTokens = [NSSet setWithSet:tokensToDelete] ;
-                NSDictionary* userInfo = [NSDictionary dictionaryWithObject:deletedTokens
-                                                                     forKey:RPTokenControlUserDeletedTokensKey] ;
-                [[NSNotificationCenter defaultCenter] postNotificationName:RPTokenControlUserDeletedTokensNotification
-                                                                    object:self
-                                                                  userInfo:userInfo] ;
-                
-                // Invoke the KVC-compliant setter
-                [self setObjectValue:newTokens] ;
+    NSIndexSet* selectedIndexSet = [self selectedIndexSet] ;
+    if ([selectedIndexSet count] == 0) {
+        return NO ;
+    }
+    
+    // Get the strings to delete from the selected FramedTokens only.
+    // Indexes in _framedTokens are also indexes in _layoutCore, except for
+    // that of the ellipsisToken, which cannot be deleted.
+    FramedToken* ellipsisFramedToken = [_layoutCore ellipsisFramedToken] ;
+    NSMutableSet* stringsToDelete = [[NSMutableSet alloc] initWithCapacity:[selectedIndexSet count]] ;
+    NSMutableIndexSet* indexesToDelete = [[NSMutableIndexSet alloc] init] ;
+    NSUInteger nFramedTokens = [_framedTokens count] ;
+    NSUInteger i = [selectedIndexSet firstIndex] ;
+    while ((i != NSNotFound) && (i < nFramedTokens)) {
+        FramedToken* framedToken = [_framedTokens objectAtIndex:i] ;
+        if (framedToken != ellipsisFramedToken) {
+            [stringsToDelete addObject:[framedToken text]] ;
+            [indexesToDelete addIndex:i] ;
+        }
+        i = [selectedIndexSet indexGreaterThanIndex:i] ;
+    }
+    
+    // Remove them from objectValue.  We do not use -setObjectValue: because
+    // we already know that this is a substantive change, so there is no need
+    // to compare the old and new strings.
+    NSMutableSet* deletedTokens = [[NSMutableSet alloc] init] ;
+    BOOL didNotifyWillChange = NO ;
+    BOOL canUpdateLayoutCore = NO ;
+    RPTokenControlSnapshot* newSnapshot = nil ;
+    while (YES) {
+        RPTokenControlSnapshot* current = [self snapshot] ;
+        id oldTokens = [current objectValue] ;
+        [deletedTokens removeAllObjects] ;
+        id newTokens = [oldTokens copyRemovingStrings:stringsToDelete
+                                       deletedStrings:deletedTokens] ;
+        if ([deletedTokens count] == 0) {
+            // Must be a state marker, or another thread has removed them
 #if !__has_feature(objc_arc)
-                [newTokens release];
+            [newTokens release];
 #endif
-                
-                // Deselect the selected tokens
-                [self deselectAllIndexes] ;
-                [self invalidateLayout] ;
-                
-                [[self window] makeFirstResponder:self] ;
-            }
-            
-            didDelete = ([tokensToDelete count] > 0) ;
+            break ;
         }
-        else {
-            // Must be a state marker.  Nothing to delete.
+        
+        if (!didNotifyWillChange) {
+            // If a retry finds nothing to delete, objectValue has still
+            // changed meanwhile, by another thread, so this is balanced by
+            // -didChangeValueForKey: below in any case.
+            [self willChangeValueForKey:@"objectValue"] ;
+            didNotifyWillChange = YES ;
         }
+        
+        // _layoutCore can be updated instead of rebuilt only if it was built
+        // from oldTokens, and each object removed was one selected token.
+        // The latter is not so if, for example, an array has duplicates.
+        canUpdateLayoutCore = (
+                               ([current version] == [_layoutCore objectValueVersion])
+                               && ([(NSSet*)oldTokens count] - [(NSSet*)newTokens count] == [indexesToDelete count])
+                               && (_firstTokenToDisplay == 0)
+                               && ((NSInteger)[(NSSet*)oldTokens count] <= _maxTokensToDisplay)
+                               ) ;
+        RPTokenControlSnapshot* candidate = [current snapshotWithUnsharedObjectValue:newTokens] ;
 #if !__has_feature(objc_arc)
-        [tokensToDelete release];
+        [newTokens release];
 #endif
+        if ([self replaceSnapshot:current
+                     withSnapshot:candidate]) {
+            newSnapshot = candidate ;
+            break ;
+        }
+        // Another thread replaced objectValue meanwhile.  Try again.
     }
-
+    
+    if (didNotifyWillChange) {
+        [self didChangeValueForKey:@"objectValue"] ;
+    }
+    
+    BOOL didDelete = (newSnapshot != nil) ;
+    if (didDelete) {
+        // Only now do we know which tokens were actually deleted, by the
+        // attempt which succeeded.
+        NSDictionary* userInfo = [NSDictionary dictionaryWithObject:[NSSet setWithSet:deletedTokens]
+                                                             forKey:RPTokenControlUserDeletedTokensKey] ;
+        [[NSNotificationCenter defaultCenter] postNotificationName:RPTokenControlUserDeletedTokensNotification
+                                                            object:self
+                                                          userInfo:userInfo] ;
+        
+        // Deselect the selected tokens.  Unlike -deselectAllIndexes, we need
+        // not mark each one as needing display, since we redisplay all.
+        [self setSelectedIndexSet:[NSIndexSet indexSet]] ;
+        _lastSelectedIndex = NSNotFound ;
+        [self setTokenBeingEdited:nil] ;
+        
+        // Since the remaining tokens have not changed, we can close the gaps
+        // without measuring them again, unless their font sizes would change.
+        if (
+            canUpdateLayoutCore
+            && ([_layoutCore indexOfTokenBeingEdited] == NSNotFound)
+            && (([self fixedFontSize] > 0) || ![_layoutCore allTokensOfSomeCountAreAtIndexes:indexesToDelete])
+            ) {
+            [_layoutCore removeFramedTokensAtIndexes:indexesToDelete] ;
+            [_layoutCore setObjectValueVersion:[newSnapshot version]] ;
+            [self invalidateLineBreaks] ;
+        }
+        else {
+            [self invalidateLayout] ;
+        }
+        
+        [[self window] makeFirstResponder:self] ;
+    }
+    
+#if !__has_feature(objc_arc)
+    [stringsToDelete release];
+    [indexesToDelete release];
+    [deletedTokens release];
+#endif
+    
     return didDelete ;
 }
 
@@ -2119,6 +2880,12 @@ const float halfRingWidth = 2.0 ;
 
 #pragma mark * Superclass Overrides (Basic Infrastructure)
 
+- (void)viewDidEndLiveResize {
+	[super viewDidEndLiveResize] ;
+	// Tokens' toolTip rects were not added during live resize
+	[self updateToolTipRects] ;
+}
+
 // Because this NSControl does not have an NSActionCell, the
 // following voodoo is needed to give it a cellClass.   Otherwise,
 // its -setTarget and -setAction, or any such connection in 
@@ -2174,6 +2941,8 @@ const float halfRingWidth = 2.0 ;
 - (id) initWithFrame:(NSRect)frame {
 	self = [super initWithFrame:frame];
 	if (self != nil) {
+		[self initSnapshotWithTokenizingCharacter:0
+									 linkDragType:nil] ;
 		[self initCommon];
 	}
 	
@@ -2195,7 +2964,8 @@ const float halfRingWidth = 2.0 ;
 	[coder encodeBool:_showsCountsAsToolTips forKey:constKeyShowsCountsAsToolTips] ;
     [coder encodeBool:m_canDeleteTags forKey:constKeyCanDeleteTags] ;
 	[coder encodeBool:_isDoingLayout forKey:constKeyIsDoingLayout] ;
-	[coder encodeBytes:(const uint8_t*)&m_tokenizingCharacter length:sizeof(unichar) forKey:constKeyTokenizingCharacter] ;
+	unichar tokenizingCharacter = [self tokenizingCharacter] ;
+	[coder encodeBytes:(const uint8_t*)&tokenizingCharacter length:sizeof(unichar) forKey:constKeyTokenizingCharacter] ;
 	[coder encodeInteger:_firstTokenToDisplay forKey:constKeyFirstTokenToDisplay] ;
 	[coder encodeInteger:_fancyEffects forKey:constKeyFancyEffects] ;
 	[coder encodeObject:m_delegate forKey:constKeyDelegate] ;
@@ -2209,7 +2979,7 @@ const float halfRingWidth = 2.0 ;
 	[coder encodeObject:m_noSelectionPlaceholder forKey:constKeyNoSelectionPlaceholder] ;
 	[coder encodeObject:m_multipleValuesPlaceholder forKey:constKeyMultipleValuesPlaceholder] ;
 	[coder encodeObject:m_notApplicablePlaceholder forKey:constKeyNotApplicablePlaceholder] ;
-	[coder encodeObject:_linkDragType forKey:constKeyLinkDragType] ;
+	[coder encodeObject:[self linkDragType] forKey:constKeyLinkDragType] ;
 	[coder encodeObject:_textField forKey:constKeyTextField] ;
 }
 
@@ -2223,7 +2993,7 @@ const float halfRingWidth = 2.0 ;
         m_canDeleteTags = [coder decodeBoolForKey:constKeyCanDeleteTags] ;
         _isDoingLayout = [coder decodeBoolForKey:constKeyIsDoingLayout] ;
         const uint8* tokenizingCharacter_p = [coder decodeBytesForKey:constKeyTokenizingCharacter returnedLength:&betterBeLengthOfUnichar] ;
-        m_tokenizingCharacter = (unichar)*tokenizingCharacter_p;
+        unichar tokenizingCharacter = (unichar)*tokenizingCharacter_p;
         _firstTokenToDisplay = [coder decodeIntegerForKey:constKeyFirstTokenToDisplay] ;
         _fancyEffects = [coder decodeIntegerForKey:constKeyFancyEffects] ;
         m_delegate = [coder decodeObjectForKey:constKeyDelegate];
@@ -2237,7 +3007,9 @@ const float halfRingWidth = 2.0 ;
         m_noSelectionPlaceholder = [coder decodeObjectForKey:constKeyNoSelectionPlaceholder];
         m_multipleValuesPlaceholder = [coder decodeObjectForKey:constKeyMultipleValuesPlaceholder];
         m_notApplicablePlaceholder = [coder decodeObjectForKey:constKeyNotApplicablePlaceholder];
-        _linkDragType = [coder decodeObjectForKey:constKeyLinkDragType];
+        NSString* linkDragType = [coder decodeObjectForKey:constKeyLinkDragType];
+        [self initSnapshotWithTokenizingCharacter:tokenizingCharacter
+                                     linkDragType:linkDragType] ;
         _textField = [coder decodeObjectForKey:constKeyTextField];
 #if !__has_feature(objc_arc)
         [m_delegate retain];
@@ -2251,7 +3023,6 @@ const float halfRingWidth = 2.0 ;
         [m_noSelectionPlaceholder retain];
         [m_multipleValuesPlaceholder retain];
         [m_notApplicablePlaceholder retain];
-        [_linkDragType retain];
         [_textField retain];
 #endif
         [self initCommon] ;
@@ -2260,9 +3031,10 @@ const float halfRingWidth = 2.0 ;
 }
 
 - (void)dealloc {
+	// No thread can be reading our snapshots now
+	RPSnapshotCellDestroy(&_snapshotCell) ;
 #if !__has_feature(objc_arc)
 	[_dragImage release] ;
-	[_linkDragType release] ;
 	[_tokenBeingEdited release] ;
 	[m_disallowedCharacterSet release] ;
 	[m_replacementString release] ;
@@ -2274,8 +3046,9 @@ const float halfRingWidth = 2.0 ;
 	[_selectedIndexSet release] ;
 	[_textField release] ;
 	[_framedTokens release] ;
+	[_layoutCore release] ;
 	[_truncatedTokens release] ;
-	[m_objectValue release] ;
+	[_layoutContext release] ;
     [_accessibilityChildren release];
 #endif
 
@@ -2297,6 +3070,69 @@ const float halfRingWidth = 2.0 ;
 	return YES ;
 }
 
+/*!
+ @brief    Draws a given framed token by drawing an image of it from the
+ layoutContext, first rendering and caching the image if necessary
+
+ @details  The cache key includes everything which affects the appearance
+ of a token, so that tokens which look the same in different RPTokenControls
+ sharing a layoutContext are rendered only once.
+*/
+- (void)drawCachedFramedToken:(FramedToken*)framedToken
+			   withAttributes:(NSDictionary*)attr
+				   isSelected:(BOOL)isSelected
+			   renderStyleKey:(NSString*)renderStyleKey {
+	NSRect bounds = [framedToken bounds] ;
+	BOOL appendCount = _appendCountsToStrings ;
+	NSString* key = [framedToken renderKeyForStyle:renderStyleKey
+									   appendCount:appendCount
+										isSelected:isSelected] ;
+	RPTokenLayoutContext* layoutContext = [self layoutContext] ;
+	NSImage* image = [layoutContext renderedTokenForKey:key] ;
+	if (!image) {
+		NSRect imageBounds = NSMakeRect(0.0, 0.0, bounds.size.width, bounds.size.height) ;
+		// NSImage may run the drawing handler again later, for example for
+		// another backing scale, when some other appearance is current.  So
+		// we resolve dynamic colors now, while our appearance is current,
+		// so that the image always matches its key.
+		NSMutableDictionary* resolvedAttr = [NSMutableDictionary dictionaryWithDictionary:attr] ;
+		for (NSString* attrName in attr) {
+			id value = [attr objectForKey:attrName] ;
+			if ([value isKindOfClass:[NSColor class]]) {
+				NSColor* resolvedColor = [(NSColor*)value colorUsingColorSpace:[NSColorSpace sRGBColorSpace]] ;
+				if (resolvedColor) {
+					[resolvedAttr setObject:resolvedColor
+									 forKey:attrName] ;
+				}
+			}
+		}
+		image = [NSImage imageWithSize:bounds.size
+							   flipped:YES
+						drawingHandler:^BOOL(NSRect dstRect) {
+							[framedToken drawInBounds:imageBounds
+									   withAttributes:resolvedAttr
+										  appendCount:appendCount] ;
+							return YES ;
+						}] ;
+		[layoutContext setRenderedToken:image
+								 forKey:key] ;
+	}
+	
+	// Justification puts tokens at fractional x.  Drawing the image there
+	// would resample it and blur the text, so we snap to device pixels.
+	NSPoint origin = [self convertPointToBacking:bounds.origin] ;
+	origin.x = round(origin.x) ;
+	origin.y = round(origin.y) ;
+	bounds.origin = [self convertPointFromBacking:origin] ;
+	
+	[image drawInRect:bounds
+			 fromRect:NSZeroRect
+			operation:NSCompositingOperationSourceOver
+			 fraction:1.0
+	   respectFlipped:YES
+				hints:nil] ;
+}
+
 - (void)drawRect:(NSRect)rect {	
     if(_backgroundWhiteness < 1.0) {
         [[NSColor colorWithCalibratedWhite:_backgroundWhiteness alpha:1.0] set];
@@ -2363,6 +3199,28 @@ const float halfRingWidth = 2.0 ;
 #if !__has_feature(objc_arc)
 		[shadow release];
 #endif
+		
+		// Drawing from images pays off only if they are shared with other
+		// controls, or redrawn often, as in cell style.
+		BOOL drawsCachedImages = (
+								  (_fancyEffects == 0)
+								  && ([[self layoutContext] isForSharing] || [self isCellStyle])
+								  ) ;
+		
+		// Identifies everything besides the token and its selection which
+		// affects cached token images.  The selected fillColor may be a
+		// dynamic system color, so it is resolved, now that our appearance
+		// is current, to catch changes in accent color as well as appearance.
+		NSString* renderStyleKey = nil ;
+		if (drawsCachedImages) {
+			renderStyleKey = [NSString stringWithFormat:@"%ld\t%g\t%g\t%d\t%@\t%@",
+							  (long)_tokenColorScheme,
+							  _cornerRadiusFactor,
+							  _widthPaddingMultiplier,
+							  _appendCountsToStrings,
+							  [[self effectiveAppearance] name],
+							  [fillColor colorUsingColorSpace:[NSColorSpace sRGBColorSpace]]] ;
+		}
         
 		// Draw tokens that need to be drawn
         NSInteger i = 0 ;
@@ -2378,12 +3236,18 @@ const float halfRingWidth = 2.0 ;
 				// by our _textField for editing.
 				continue ;
 			}
-			if([self isSelectedFramedToken:framedToken]) {
-				[framedToken drawWithAttributes:attrSelected
-									appendCount:_appendCountsToStrings];
+			BOOL isSelected = [self isSelectedFramedToken:framedToken] ;
+			NSDictionary* attr = isSelected ? attrSelected : attrDeselected ;
+			if (drawsCachedImages) {
+				// Shadows and reflections spill outside of the token's bounds,
+				// so only plain tokens can be drawn from cached images.
+				[self drawCachedFramedToken:framedToken
+							 withAttributes:attr
+								 isSelected:isSelected
+							 renderStyleKey:renderStyleKey] ;
 			}
 			else {
-				[framedToken drawWithAttributes:attrDeselected
+				[framedToken drawWithAttributes:attr
 									appendCount:_appendCountsToStrings] ;
 			}
 			
@@ -2733,9 +3597,23 @@ const float halfRingWidth = 2.0 ;
     NSMutableSet* extraChildren = [[NSMutableSet setWithArray:_accessibilityChildren] mutableCopy];
     NSMutableSet* missingChildren = [NSMutableSet new];
     for (FramedToken* framedToken in _framedTokens) {
+        NSRect frame = [framedToken bounds];
+        /* It seems like, since self is assigned to the child's
+         accessibilityParent, Cocoa should be smart enough to ask parent if
+         it -isFlipped and do the flipping for us.  However, testing in
+         macOS 10.12, we find that, without the following flip, the black
+         VoiceOver rectangles begin from the bottom of the RPTokenControl
+         instead of from the top.  Am I missing something? */
+        if (self.isFlipped) {
+            frame.origin.y = self.frame.size.height - frame.origin.y - frame.size.height;
+        }
+
         BOOL alreadyExists = NO;
         for (FramedTokenAccessibilityElement* child in _accessibilityChildren) {
             if (framedToken == child.framedToken) {
+                /* FramedTokens survive a change in our width, but move to
+                 new lines, so the frame of an existing child may be stale. */
+                child.accessibilityFrameInParentSpace = frame;
                 [extraChildren removeObject:child];
                 alreadyExists = YES;
                 break;
@@ -2746,16 +3624,6 @@ const float halfRingWidth = 2.0 ;
             FramedTokenAccessibilityElement* child = [[FramedTokenAccessibilityElement alloc] initWithTokenControl:self
                                                                                                        framedToken:framedToken];
             child.accessibilityParent = self;
-            NSRect frame = [framedToken bounds];
-            /* It seems like, since self is assigned to the child's
-             accessibilityParent, Cocoa should be smart enough to ask parent if
-             it -isFlipped and do the flipping for us.  However, testing in
-             macOS 10.12, we find that, without the following flip, the black
-             VoiceOver rectangles begin from the bottom of the RPTokenControl
-             instead of from the top.  Am I missing something? */
-            if (self.isFlipped) {
-                frame.origin.y = self.frame.size.height - frame.origin.y - frame.size.height;
-            }
             child.accessibilityFrameInParentSpace = frame;
 
             [missingChildren addObject:child];
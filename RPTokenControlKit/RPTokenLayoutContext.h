@@ -0,0 +1,108 @@
+#import <Cocoa/Cocoa.h>
+
+/*!
+ @brief    RPTokenLayoutContext holds the caches which RPTokenControl uses to
+ lay out and draw its tokens, so that they may be shared by many controls.
+ @detail
+ <h3>INHERITANCE</h3>
+ RPTokenLayoutContext is a subclass of NSObject
+ <h3>DISCUSSION</h3>
+ Each RPTokenControl measures the text of each of its tokens during layout, and
+ draws each token during -drawRect:.  If you have many RPTokenControls which
+ display mostly the same tokens, for example one tag cloud in each row of
+ a table view, most of this work is repeated.  To avoid that, create one
+ RPTokenLayoutContext and set it as the layoutContext of all of those
+ RPTokenControls.  The context caches:
+ <ul>
+ <li>the measured size of each token's text.  In a context created with -init,
+ font sizes are rounded to the nearest half point for measuring, and the result
+ is scaled, so that controls whose font sizes differ slightly still share
+ measurements.</li>
+ <li>one interned instance of each token's text, so that all controls share
+ the same string objects instead of each retaining their own copies</li>
+ <li>rendered images of tokens, so that a token which looks the same in
+ several controls is only drawn from scratch once</li>
+ </ul>
+ If you do not set a layoutContext, each RPTokenControl creates its own
+ private instance with -initForSharing:NO, which measures text at the exact
+ font size.  Such a control draws its tokens directly, as it did before this
+ class existed, unless it is in cell style, in which case it still draws them
+ from cached images.
+
+ Like the RPTokenControls which use it, an RPTokenLayoutContext should only be
+ used on the main thread.
+ <h3>VERSION HISTORY, AUTHOR, ETC.</h3>
+ See RPTokenControl.h for this info.
+ */
+@interface RPTokenLayoutContext : NSObject {
+	BOOL _forSharing ;
+	NSCache* _textSizes ;
+	NSHashTable* _internedStrings ;
+	NSCache* _renderedTokens ;
+}
+
+/*!
+ @brief    Designated initializer
+
+ @details  -init invokes this with forSharing:YES.
+ @param    forSharing  YES if the receiver is to be shared by many
+ RPTokenControls, so that text should be measured at quantized font sizes,
+ and tokens drawn from cached images.  NO if the receiver is private to one
+ RPTokenControl, so that text should be measured at the exact font size.
+ */
+- (id)initForSharing:(BOOL)forSharing ;
+
+/*!
+ @brief    Returns the forSharing parameter with which the receiver was
+ initialized
+ */
+- (BOOL)isForSharing ;
+
+/*!
+ @brief    Returns an instance of a string equal to a given string which is
+ shared by all users of the receiver
+
+ @details  If the receiver has not yet interned a string equal to the given
+ string, it interns an immutable copy of the given string and returns that.
+ Interned strings are held weakly, and are forgotten when no longer used.
+ @param    string  The string to be interned.  If nil, returns nil.
+ */
+- (NSString*)internedString:(NSString*)string ;
+
+/*!
+ @brief    Returns the size which a given string occupies when drawn in the
+ label font of a given size, from the cache if possible
+
+ @details  This is nearly equivalent to, but, on cache hits, much cheaper
+ than -[NSString sizeWithAttributes:].  If the receiver is for sharing, the
+ text is measured at the given font size rounded to the nearest half point,
+ and the result is scaled to the given font size.  Otherwise, it is measured
+ at the given font size.  All sizes share one cache of bounded size.
+ */
+- (NSSize)textSizeForString:(NSString*)string
+				   fontSize:(float)fontSize ;
+
+/*!
+ @brief    Returns a previously rendered token image for a given key, or nil
+ if there is none cached for that key
+ */
+- (NSImage*)renderedTokenForKey:(NSString*)key ;
+
+/*!
+ @brief    Caches a rendered token image for a given key
+
+ @details  The cache is an NSCache, so images may be evicted at any time,
+ for example when memory is low.
+ */
+- (void)setRenderedToken:(NSImage*)image
+				  forKey:(NSString*)key ;
+
+/*!
+ @brief    Empties all of the receiver's caches
+
+ @details  You might want to invoke this if, for example, the system font
+ has changed.
+ */
+- (void)removeAllCachedObjects ;
+
+@end
@@ -0,0 +1,161 @@
+#import "RPTokenLayoutContext.h"
+
+// Rendered tokens are bitmaps, so we limit how many are kept
+NSUInteger const RPTokenLayoutContextRenderedTokensCountLimit = 2000 ;
+// Text sizes are small, but we still limit how many are kept
+NSUInteger const RPTokenLayoutContextTextSizesCountLimit = 20000 ;
+// Font sizes are interpolated from each control's own ranking of counts, so
+// they rarely match exactly from one control to another.  Text is measured
+// at font sizes rounded to this increment, in points, and then scaled, so
+// that controls whose font sizes are close can share measurements.
+CGFloat const RPTokenLayoutContextFontSizeIncrement = 0.5 ;
+
+/*!
+ @brief    Key for the size of a given string at a given font size
+*/
+@interface RPTextSizeKey : NSObject {
+	NSString* _string ;
+	CGFloat _fontSize ;
+}
+@end
+
+@implementation RPTextSizeKey
+
+- (id)initWithString:(NSString*)string
+			fontSize:(CGFloat)fontSize {
+	if ((self = [super init])) {
+		// Copy, since string may be the token being edited
+		_string = [string copy] ;
+		_fontSize = fontSize ;
+	}
+	
+	return self ;
+}
+
+- (void)dealloc {
+#if !__has_feature(objc_arc)
+	[_string release] ;
+	
+	[super dealloc] ;
+#endif
+}
+
+- (BOOL)isEqual:(id)other {
+	if (![other isKindOfClass:[RPTextSizeKey class]]) {
+		return NO ;
+	}
+	
+	return (
+			(_fontSize == ((RPTextSizeKey*)other)->_fontSize)
+			&& [_string isEqualToString:((RPTextSizeKey*)other)->_string]
+			) ;
+}
+
+- (NSUInteger)hash {
+	return [_string hash] ^ (NSUInteger)(_fontSize / RPTokenLayoutContextFontSizeIncrement) ;
+}
+
+@end
+
+@implementation RPTokenLayoutContext
+
+- (id)initForSharing:(BOOL)forSharing {
+	if ((self = [super init])) {
+		_forSharing = forSharing ;
+		_textSizes = [[NSCache alloc] init] ;
+		[_textSizes setCountLimit:RPTokenLayoutContextTextSizesCountLimit] ;
+		_internedStrings = [[NSHashTable alloc] initWithOptions:NSPointerFunctionsWeakMemory
+													   capacity:0] ;
+		_renderedTokens = [[NSCache alloc] init] ;
+		[_renderedTokens setCountLimit:RPTokenLayoutContextRenderedTokensCountLimit] ;
+	}
+
+	return self ;
+}
+
+- (id)init {
+	return [self initForSharing:YES] ;
+}
+
+- (void)dealloc {
+#if !__has_feature(objc_arc)
+	[_textSizes release] ;
+	[_internedStrings release] ;
+	[_renderedTokens release] ;
+
+	[super dealloc] ;
+#endif
+}
+
+- (BOOL)isForSharing {
+	return _forSharing ;
+}
+
+- (NSString*)internedString:(NSString*)string {
+	if (!string) {
+		return nil ;
+	}
+
+	NSString* interned = [_internedStrings member:string] ;
+	if (!interned) {
+		interned = [[string copy] autorelease] ;
+		[_internedStrings addObject:interned] ;
+	}
+
+	return interned ;
+}
+
+- (NSSize)textSizeForString:(NSString*)string
+				   fontSize:(float)fontSize {
+	CGFloat measuredFontSize = fontSize ;
+	if (_forSharing) {
+		measuredFontSize = round(fontSize / RPTokenLayoutContextFontSizeIncrement) * RPTokenLayoutContextFontSizeIncrement ;
+	}
+	if (measuredFontSize <= 0.0) {
+		measuredFontSize = fontSize ;
+	}
+	RPTextSizeKey* key = [[RPTextSizeKey alloc] initWithString:string
+													  fontSize:measuredFontSize] ;
+	NSValue* sizeValue = [_textSizes objectForKey:key] ;
+	NSSize size ;
+	if (sizeValue) {
+		size = [sizeValue sizeValue] ;
+	}
+	else {
+		// The font must be the same as that returned by +[FramedToken fontOfSize:]
+		NSDictionary* attr = [NSDictionary dictionaryWithObject:[NSFont labelFontOfSize:measuredFontSize]
+														 forKey:NSFontAttributeName] ;
+		size = [string sizeWithAttributes:attr] ;
+		[_textSizes setObject:[NSValue valueWithSize:size]
+					   forKey:key] ;
+	}
+#if !__has_feature(objc_arc)
+	[key release] ;
+#endif
+	
+	// Text size is very nearly proportional to font size
+	CGFloat scale = fontSize / measuredFontSize ;
+	size.width *= scale ;
+	size.height *= scale ;
+	
+	return size ;
+}
+
+- (NSImage*)renderedTokenForKey:(NSString*)key {
+	return [_renderedTokens objectForKey:key] ;
+}
+
+- (void)setRenderedToken:(NSImage*)image
+				  forKey:(NSString*)key {
+	if (image) {
+		[_renderedTokens setObject:image
+							forKey:key] ;
+	}
+}
+
+- (void)removeAllCachedObjects {
+	[_textSizes removeAllObjects] ;
+	[_renderedTokens removeAllObjects] ;
+}
+
+@end
@@ -0,0 +1,202 @@
+/*
+ Concurrent stress test of RPSnapshotCell.
+
+ Reader threads repeatedly copy the current snapshot and check that it has
+ not been deallocated while they hold it.  Writer threads repeatedly replace
+ it.  Deallocated snapshots are not freed until the end, but are marked dead,
+ so that a snapshot released too early is detected instead of being reused.
+ At the end, checks that the retired list drains and that every snapshot
+ except the current one has been deallocated exactly once.
+
+ Build and run with the Makefile in this directory:
+     make test
+ or, with ThreadSanitizer:
+     make tsan
+*/
+
+#include "RPSnapshotCell.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum {
+	SnapshotStateLive = 0x11111111,
+	SnapshotStateDead = 0x0DEADDEA
+} ;
+
+typedef struct Snapshot {
+	atomic_int state ;
+	atomic_long refCount ;
+	long value ;
+	// Always ~value, to detect torn or garbage reads
+	long check ;
+	struct Snapshot* nextDead ;
+} Snapshot ;
+
+static RPSnapshotCell cell ;
+static atomic_long nAllocated ;
+static atomic_long nDeallocated ;
+static atomic_long nFailures ;
+static atomic_long nReplacements ;
+static _Atomic(Snapshot*) graveyard ;
+
+static void fail(const char* message) {
+	atomic_fetch_add(&nFailures, 1) ;
+	fprintf(stderr, "FAILED: %s\n", message) ;
+}
+
+static Snapshot* newSnapshot(long value) {
+	Snapshot* snapshot = malloc(sizeof(Snapshot)) ;
+	if (!snapshot) {
+		fprintf(stderr, "Out of memory\n") ;
+		exit(2) ;
+	}
+	atomic_init(&snapshot->state, SnapshotStateLive) ;
+	atomic_init(&snapshot->refCount, 1) ;
+	snapshot->value = value ;
+	snapshot->check = ~value ;
+	snapshot->nextDead = NULL ;
+	atomic_fetch_add(&nAllocated, 1) ;
+	return snapshot ;
+}
+
+static atomic_long nRetains ;
+
+static void* retainSnapshot(void* p) {
+	Snapshot* snapshot = p ;
+	// RPSnapshotCellCopyCurrent() calls this between loading the pointer and
+	// retaining it, which is the window in which an early release would be
+	// fatal.  Widen the window now and then, so that writers get a chance to
+	// run in it, even on a single CPU.
+	if ((atomic_fetch_add(&nRetains, 1) % 16) == 0) {
+		sched_yield() ;
+	}
+	if (atomic_fetch_add(&snapshot->refCount, 1) <= 0) {
+		fail("retained a snapshot which had already been deallocated") ;
+	}
+	return snapshot ;
+}
+
+static void releaseSnapshot(void* p) {
+	Snapshot* snapshot = p ;
+	long priorRefCount = atomic_fetch_sub(&snapshot->refCount, 1) ;
+	if (priorRefCount <= 0) {
+		fail("released a snapshot which had already been deallocated") ;
+	}
+	else if (priorRefCount == 1) {
+		if (atomic_exchange(&snapshot->state, SnapshotStateDead) != SnapshotStateLive) {
+			fail("deallocated a snapshot twice") ;
+		}
+		atomic_fetch_add(&nDeallocated, 1) ;
+		// Instead of freeing, keep it in the graveyard until the end
+		Snapshot* head = atomic_load(&graveyard) ;
+		do {
+			snapshot->nextDead = head ;
+		} while (!atomic_compare_exchange_weak(&graveyard, &head, snapshot)) ;
+	}
+}
+
+static long nIterations = 200000 ;
+
+static void* readerMain(void* arg) {
+	(void)arg ;
+	long lastValue = -1 ;
+	long i ;
+	for (i=0; i<nIterations; i++) {
+		Snapshot* snapshot = RPSnapshotCellCopyCurrent(&cell) ;
+		if (atomic_load(&snapshot->state) != SnapshotStateLive) {
+			fail("reader got a deallocated snapshot") ;
+		}
+		if (snapshot->check != ~snapshot->value) {
+			fail("reader got a corrupt snapshot") ;
+		}
+		if (snapshot->value < lastValue) {
+			fail("reader went back in time") ;
+		}
+		lastValue = snapshot->value ;
+		if ((i % 64) == 0) {
+			// Hold it a while, giving writers a chance to retire it
+			sched_yield() ;
+		}
+		if (atomic_load(&snapshot->state) != SnapshotStateLive) {
+			fail("snapshot was deallocated while a reader held it") ;
+		}
+		releaseSnapshot(snapshot) ;
+	}
+
+	return NULL ;
+}
+
+static void* writerMain(void* arg) {
+	(void)arg ;
+	long i ;
+	for (i=0; i<nIterations/4; i++) {
+		Snapshot* current = RPSnapshotCellCopyCurrent(&cell) ;
+		Snapshot* replacement = newSnapshot(current->value + 1) ;
+		if (RPSnapshotCellReplace(&cell, current, replacement)) {
+			atomic_fetch_add(&nReplacements, 1) ;
+		}
+		else {
+			releaseSnapshot(replacement) ;
+		}
+		releaseSnapshot(current) ;
+	}
+
+	return NULL ;
+}
+
+int main(int argc, const char* argv[]) {
+	const int nReaders = 8 ;
+	const int nWriters = 4 ;
+	if (argc > 1) {
+		nIterations = atol(argv[1]) ;
+	}
+
+	RPSnapshotCellInit(&cell, newSnapshot(0), retainSnapshot, releaseSnapshot) ;
+
+	pthread_t threads[nReaders + nWriters] ;
+	int i ;
+	for (i=0; i<nReaders + nWriters; i++) {
+		if (pthread_create(&threads[i], NULL, (i < nReaders) ? readerMain : writerMain, NULL) != 0) {
+			fprintf(stderr, "Could not create thread\n") ;
+			return 2 ;
+		}
+	}
+	for (i=0; i<nReaders + nWriters; i++) {
+		pthread_join(threads[i], NULL) ;
+	}
+
+	// With no readers left, the retired list must drain
+	RPSnapshotCellReclaim(&cell) ;
+	if (RPSnapshotCellRetiredCount(&cell) != 0) {
+		fail("retired list did not drain") ;
+	}
+	if (atomic_load(&nAllocated) - atomic_load(&nDeallocated) != 1) {
+		fail("snapshots other than the current one are still allocated") ;
+	}
+	Snapshot* current = RPSnapshotCellCopyCurrent(&cell) ;
+	if (current->value != atomic_load(&nReplacements)) {
+		fail("a replacement was lost") ;
+	}
+	releaseSnapshot(current) ;
+
+	RPSnapshotCellDestroy(&cell) ;
+	if (atomic_load(&nAllocated) != atomic_load(&nDeallocated)) {
+		fail("destroying the cell did not deallocate all snapshots") ;
+	}
+
+	Snapshot* dead = atomic_load(&graveyard) ;
+	while (dead) {
+		Snapshot* next = dead->nextDead ;
+		free(dead) ;
+		dead = next ;
+	}
+
+	printf("%ld snapshots, %ld replacements, %ld failures\n",
+		   atomic_load(&nAllocated),
+		   atomic_load(&nReplacements),
+		   atomic_load(&nFailures)) ;
+
+	return (atomic_load(&nFailures) == 0) ? 0 : 1 ;
+}